@@ -23,19 +23,38 @@
 
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <err.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+
+#if defined(__linux__)
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>      // FICLONERANGE
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+    ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 27 ) )
+ #define HAVE_COPY_FILE_RANGE   1
+#endif
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 #include "rkcrc.h"
 #include "rkafp.h"
@@ -55,7 +74,7 @@ const char* appname;
 
 
 /// Round up to nearest multiple of sector size of 512
-inline unsigned round_up( unsigned aSize )
+inline uint64_t round_up( uint64_t aSize )
 {
     return ((aSize + 511)/512) * 512;
 }
@@ -78,440 +97,3668 @@ static std::string  std_string( const char* aByteArray, int aMaxLength )
 }
 
 
-uint32_t filestream_crc( FILE* fs, size_t stream_len )
-{
-    char buffer[1024*16];
-
-    uint32_t crc = 0;
-
-    unsigned read_len;
+/// How many worker threads the parallel paths may use, 0 means one per core.
+unsigned    Jobs = 0;
 
-    while( stream_len )
-    {
-        // we may not intend to read to the end of file, so limit read_len.
-        unsigned read_len = stream_len < sizeof(buffer) ? stream_len : sizeof(buffer);
+/// Whether -pack also shares one payload between different files of equal content.
+bool        DedupContent = false;
 
-        read_len = fread( buffer, 1, read_len, fs );
-        if( !read_len )
-            break;
+/// Whether -pack writes the extended container, UPDATE_HEADER64, instead of an UPDATE_HEADER.
+bool        Extended = false;
 
-        RKCRC( crc, buffer, read_len );
-        stream_len -= read_len;
-    }
+static unsigned job_count()
+{
+    unsigned n = Jobs ? Jobs : std::thread::hardware_concurrency();
 
-    return crc;
+    return n ? n : 1;
 }
 
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// unpack functions
-
-int create_dir( char* dir )
+/**
+ * Function run_jobs
+ * calls aTask( i ) for every i in [0, aCount) on up to job_count() threads,
+ * the calling one included, handing out the indices in increasing order.  A
+ * task returns false when it fails.  Tasks after a known failure are skipped,
+ * but all before it are always run, so the returned index of the first failed
+ * task, or aCount if none failed, does not depend on thread timing.
+ */
+static size_t run_jobs( size_t aCount, const std::function<bool( size_t )>& aTask )
 {
-    char* sep = dir;
+    std::atomic<size_t>     next( 0 );
+    std::atomic<size_t>     first_bad( aCount );
 
-    while( *sep && ( sep = strchr( sep, '/' ) ) != NULL )
+    auto worker = [&]()
     {
-        if( sep == dir )        // an absolute path was passed.
-            ++sep;
-        else
+        size_t i;
+
+        while( ( i = next++ ) < aCount )
         {
-            *sep = '\0';
+            if( i > first_bad || aTask( i ) )
+                continue;
 
-            if( mkdir( dir, 0755 ) != 0 && errno != EEXIST )
-            {
-                fprintf( stderr, "%s: can't create directory: %s\n", __func__, dir );
-                return -1;
-            }
+            size_t bad = first_bad;
 
-            *sep++ = '/';
+            while( i < bad && !first_bad.compare_exchange_weak( bad, i ) )
+                ;
         }
-    }
+    };
 
-    return 0;
+    std::vector<std::thread>    threads;
+    unsigned                    n = std::min<size_t>( job_count(), aCount );
+
+    for( unsigned t = 1; t < n; ++t )
+        threads.push_back( std::thread( worker ) );
+
+    worker();
+
+    for( unsigned t = 0; t < threads.size(); ++t )
+        threads[t].join();
+
+    return first_bad;
 }
 
 
-int extract_file( FILE* fp, off_t offset, size_t len, const char* fullpath )
+/// true if the aLen bytes at aBuf are all zero.
+static bool all_zero( const char* aBuf, size_t aLen )
 {
-    char    buffer[1024*16];
+    // comparing the buffer against itself one byte further on lets the C
+    // library's vectorized memcmp() do the scanning.
+    return !aLen || ( !aBuf[0] && !memcmp( aBuf, aBuf + 1, aLen - 1 ) );
+}
 
-    FILE*   fp_out = fopen( fullpath, "wb" );
 
-    if( !fp_out )
-    {
-        fprintf( stderr, "%s: can't open/create file: %s\n", __func__, fullpath );
-        return -1;
-    }
+// granularity at which runs of zeros are recognized while hashing
+#define ZERO_BLOCK      4096
 
-    fseeko( fp, offset, SEEK_SET );
 
-    while( len )
-    {
-        size_t  ask = len < sizeof(buffer) ? len : sizeof(buffer);
-        size_t  got = fread( buffer, 1, ask, fp );
+/**
+ * Function seek_data
+ * returns where the next data at or after aPos lies in aFd, according to
+ * SEEK_DATA, but no further than aEnd.  Everything before it is a hole and
+ * reads as zeros.  If the file system can't tell, aPos is returned.  Past the
+ * end of file aPos is returned too, so the caller's read finds the short file.
+ */
+static uint64_t seek_data( int aFd, uint64_t aPos, uint64_t aEnd )
+{
+#if defined(SEEK_DATA)
+    off_t data = lseek( aFd, aPos, SEEK_DATA );
 
-        if( ask != got )
-        {
-            fprintf( stderr,
-                "extraction of file '%s' is bad; insufficient length in container image file\n"
-                "ask=%zu got=%zu\n",
-                fullpath,
-                ask,
-                got
-                );
-            break;
-        }
+    if( data != -1 )
+        return std::min<uint64_t>( data, aEnd );
 
-        fwrite( buffer, got, 1, fp_out );
-        len -= got;
-    }
+    struct stat st;
 
-    fclose( fp_out );
+    if( errno == ENXIO && fstat( aFd, &st ) == 0 && uint64_t( st.st_size ) > aPos )
+        return std::min<uint64_t>( st.st_size, aEnd );     // only a hole left
+#endif
 
-    return 0;
+    return aPos;
 }
 
 
-int unpack_update( const char* srcfile, const char* dstdir )
+/**
+ * Function seek_hole
+ * returns where the data starting at aPos in aFd ends, according to
+ * SEEK_HOLE, but no further than aEnd.  Without hole support that is aEnd.
+ */
+static uint64_t seek_hole( int aFd, uint64_t aPos, uint64_t aEnd )
 {
-    int ret = 0;
+#if defined(SEEK_HOLE)
+    off_t hole = lseek( aFd, aPos, SEEK_HOLE );
 
-    UPDATE_HEADER   header;
-    off_t           filesize;
+    if( hole != -1 && uint64_t( hole ) > aPos )
+        return std::min<uint64_t>( hole, aEnd );
+#endif
 
-    FILE* fp = fopen( srcfile, "rb" );
+    return aEnd;
+}
 
-    if( !fp )
-    {
-        fprintf( stderr, "%s: can't open file '%s'", __func__, srcfile );
-        ret = -4;
-        goto out;
-    }
 
-    if( sizeof(header) != fread( &header, 1, sizeof(header), fp ) )
-    {
-        fprintf( stderr, "%s: can't read image header from file '%s'", __func__, srcfile );
-        ret = -5;
-        goto out;
-    }
+/**
+ * Function crc_skip_zeros
+ * is rkcrc_update() for data which may hold long runs of zeros, such as mostly
+ * empty file system images.  Whole ZERO_BLOCKs of zeros are not hashed, they
+ * are collected and stepped over with one rkcrc_zeros() call.
+ */
+static uint32_t crc_skip_zeros( uint32_t crc, const char* buf, size_t len )
+{
+    const char* end   = buf + len;
+    const char* run   = buf;        // start of data not yet hashed
+    uint64_t    zeros = 0;          // zero bytes not yet folded in
 
-    if( strncmp( header.magic, RKAFP_MAGIC, sizeof(header.magic) ) != 0 )
+    for( const char* p = buf;  p < end;  )
     {
-        fprintf( stderr, "%s: invalid header magic id in file '%s'", __func__, srcfile );
-        ret = -6;
-        goto out;
+        size_t  n = std::min<size_t>( end - p, ZERO_BLOCK );
+
+        if( all_zero( p, n ) )
+        {
+            crc = rkcrc_update( crc, run, p - run );
+            zeros += n;
+            run = p + n;
+        }
+        else if( zeros )
+        {
+            crc = rkcrc_zeros( crc, zeros );
+            zeros = 0;
+        }
+
+        p += n;
     }
 
-    fseeko( fp, 0, SEEK_END );
+    crc = rkcrc_update( crc, run, end - run );
 
-    filesize = ftello(fp);
+    return rkcrc_zeros( crc, zeros );
+}
 
-    if( filesize - 4 != header.length )
-    {
-        fprintf( stderr,
-            "%s: update_header.length cannot be correct, cannot check CRC\n",
-            __func__
-            );
-    }
-    else
-    {
-        fseeko( fp, header.length, SEEK_SET );
 
-        uint32_t crc_read;
-        uint32_t crc_calc;
-        unsigned readcount;
+// piece of a file handed to one CRC worker at a time
+#define CRC_CHUNK       (32*1024*1024)
 
-        readcount = fread( &crc_read, 1, sizeof(crc_read), fp );
 
-        if( sizeof(crc_read) != readcount )
-        {
-            fprintf( stderr, "Can't read crc checksum, readcount=%d header.len=%u\n",
-                readcount, header.length );
-        }
+/// a byte range of a file
+struct RANGE
+{
+    uint64_t    offset;
+    uint64_t    len;
+};
 
-        printf( "Checking CRC for file '%s'...", srcfile );
-        fflush( stdout );
 
-        fseeko( fp, 0, SEEK_SET );
+struct CRC_PIECE
+{
+    unsigned    range;      // which of the ranges this is a piece of
+    uint64_t    offset;
+    uint64_t    len;
+    uint32_t    crc;
+    std::string error;
+};
 
-        crc_calc = filestream_crc( fp, header.length );
 
-        if( crc_calc != crc_read  )
-        {
-            if( filesize - 4 > header.length )
-            {
-                fprintf( stderr,
-                    "CRC_file:0x%08x CRC_calc:0x%08x mismatch, however file size was bigger than header indicated\n",
-                    crc_read,
-                    crc_calc
-                    );
-            }
-            else
-                fprintf( stderr,
-                    "CRC_file:0x%08x CRC_calc:0x%08x mismatch in file '%s'\n",
-                    crc_read,
-                    crc_calc,
-                    srcfile
-                    );
+/// is handed every buffer chunked_crc() reads, with its file offset, and
+/// returns false with *aError set to stop
+typedef std::function<bool( uint64_t aPos, const char* aData, size_t aLen, std::string* aError )> CRC_TAP;
 
-            goto out;
-        }
-        else
-            printf( "OK\n\n" );
-    }
 
-    printf( "------- UNPACKING %d partitions -------\n", header.num_parts );
+/**
+ * Function chunked_crc
+ * computes the CRC of each of aRanges of aFd into aCrcs.  The ranges are cut
+ * into CRC_CHUNK sized pieces which run_jobs() workers pread() and hash, then
+ * the piece CRCs are folded together in file order with rkcrc_combine().
+ * Holes are not read, rkcrc_zeros() steps over them and over runs of zeros in
+ * what is read.  Every buffer read is also handed to aTap, if any, on the
+ * worker that read it.  If pieces fail, the error of the first one in file
+ * order is returned in aError, whatever the thread timing.
+ */
+static int chunked_crc( int aFd, const std::vector<RANGE>& aRanges, std::vector<uint32_t>* aCrcs,
+        std::string* aError, const CRC_TAP& aTap = CRC_TAP() )
+{
+    std::vector<CRC_PIECE>  pieces;
 
-    if( header.num_parts )
+    for( unsigned r = 0; r < aRanges.size(); ++r )
     {
-        char dir[4096];
-
-        for( unsigned i = 0; i < header.num_parts; i++ )
+        for( uint64_t pos = 0; pos < aRanges[r].len; pos += CRC_CHUNK )
         {
-            UPDATE_PART* part = &header.parts[i];
+            CRC_PIECE piece;
 
-            printf( "%-60s0x%08x  0x%08x",
-                    std_string( part->fullpath, sizeof( part->fullpath ) ).c_str(),
-                    part->part_offset,
-                    part->part_bytecount
-                    );
+            piece.range  = r;
+            piece.offset = aRanges[r].offset + pos;
+            piece.len    = std::min<uint64_t>( CRC_CHUNK, aRanges[r].len - pos );
+            piece.crc    = 0;
 
-            printf( "\n" );
+            pieces.push_back( piece );
+        }
+    }
 
-            if( !strcmp( part->fullpath, "SELF" ) )
-            {
-                printf( "Skipping SELF partition file.\n" );
-                continue;
-            }
+    size_t bad = run_jobs( pieces.size(), [&]( size_t i )
+    {
+        std::vector<char>   buffer( 1024*1024 );
+        CRC_PIECE&          piece = pieces[i];
+        uint64_t            pos   = piece.offset;
+        uint64_t            end   = piece.offset + piece.len;
+        uint64_t            data_end = pos;
 
-            if( !strcmp( part->fullpath, "RESERVED" ) )
+        while( pos < end )
+        {
+            if( pos == data_end )
             {
-                printf( "Skipping RESERVED partition file.\n" );
+                uint64_t data = seek_data( aFd, pos, end );
+
+                piece.crc = rkcrc_zeros( piece.crc, data - pos );
+                pos       = data;
+                data_end  = seek_hole( aFd, pos, end );
                 continue;
             }
 
-            if( memcmp( part->name, "parameter", 9 ) == 0 )
+            size_t  ask = std::min<uint64_t>( data_end - pos, buffer.size() );
+            ssize_t got = pread( aFd, &buffer[0], ask, pos );
+
+            if( got != (ssize_t) ask )
             {
-                part->part_offset   += sizeof(PARAM_HEADER);
-                part->part_bytecount -= sizeof(PARAM_HEADER) + 4;    // CRC + PARM_HEADER
-            }
+                char msg[120];
 
-            snprintf( dir, sizeof(dir), "%s/%s", dstdir,
-                std_string( part->fullpath, sizeof( part->fullpath ) ).c_str() );
+                snprintf( msg, sizeof(msg), "file is shorter than expected, "
+                    "ask=%zu got=%zd at offset %" PRIu64, ask, got, pos );
+                piece.error = msg;
+                return false;
+            }
 
-            ret = create_dir( dir );
-            if( ret )
-                break;
+            piece.crc = crc_skip_zeros( piece.crc, &buffer[0], got );
 
-            if( part->part_offset + part->part_bytecount > header.length )
-            {
-                fprintf( stderr, "%s: partition record: '%s' has a length too long for envelop\n",
-                    __func__,
-                    std_string( part->name, sizeof( part->name ) ).c_str()
-                    );
-                ret = -2;
-                break;
-            }
+            if( aTap && !aTap( pos, &buffer[0], got, &piece.error ) )
+                return false;
 
-            ret = extract_file( fp, part->part_offset, part->part_bytecount, dir );
-            if( ret )
-                break;
+            pos += got;
         }
 
-        printf( "\n" );
+        return true;
+    } );
+
+    if( bad < pieces.size() )
+    {
+        *aError = pieces[bad].error;
+        return -1;
     }
 
-out:
-    if( fp )
-        fclose( fp );
+    aCrcs->assign( aRanges.size(), 0 );
 
-    return ret;
-}
+    for( size_t i = 0; i < pieces.size(); ++i )
+        (*aCrcs)[pieces[i].range] = rkcrc_combine( (*aCrcs)[pieces[i].range], pieces[i].crc, pieces[i].len );
 
+    return 0;
+}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// pack functions
 
-struct PACKAGE
+/// ways to get a byte range of one file into another, best first
+enum COPY_METHOD
 {
-    std::string     name;
-    std::string     fullpath;
+    COPY_CLONE,         // FICLONERANGE: share the source's extents, copy-on-write file systems
+    COPY_RANGE,         // copy_file_range(): copy inside the kernel
+    COPY_WRITE,         // pwrite() from the buffer the CRC was computed over
+};
 
-    PACKAGE( const char* aName = "", const char* aPath = "" ) :
-        name( aName ),
-        fullpath( aPath )
+
+/**
+ * Struct COPY_SINK
+ * is an output file which copy_range() fills from one particular source file,
+ * and what it has learned about the copy methods that work between the two.
+ */
+struct COPY_SINK
+{
+    std::string         name;           // for messages
+    int                 fd;
+    std::atomic<int>    method;         // best COPY_METHOD not yet known to fail
+    unsigned            blksize;        // clone granularity of the output file system
+
+    COPY_SINK() :
+        fd( -1 ),
+        method( COPY_CLONE ),
+        blksize( 4096 )
     {
     }
 
-    void Show( FILE* fp )
+    void SetFd( int aFd )
     {
-        fprintf( fp, "name:%-34s  fullpath:%s\n",
-            name.c_str(), fullpath.c_str() );
+        struct stat st;
+
+        fd = aFd;
+
+        if( fd != -1 && fstat( fd, &st ) == 0 && st.st_blksize > 0 )
+            blksize = st.st_blksize;
     }
 };
 
 
-struct PARTITION
+/**
+ * Function copy_run
+ * is copy_range() without the cloning: aLen bytes found at aSrcOffset in
+ * aSrcFd and at aBuf go to aDstOffset of aSink, by copy_file_range() while
+ * that works for the sink and by pwrite() after.
+ */
+static int copy_run( COPY_SINK& aSink, int aSrcFd, uint64_t aSrcOffset,
+        const char* aBuf, uint64_t aLen, uint64_t aDstOffset, std::string* aError )
 {
-    std::string     name;
-    unsigned        sector_start;   // at what starting sector (sector=512)
-    unsigned        sector_count;   // how many 512 sectors
+    COPY_SINK& s = aSink;
 
-    PARTITION( const std::string& aName = "", unsigned aSectorStart = 0, unsigned aSectorCount = 0 ) :
-        name( aName ),
-        sector_start( aSectorStart ),
-        sector_count( aSectorCount )
+#if defined(HAVE_COPY_FILE_RANGE)
+    if( s.method <= COPY_RANGE )
     {
-        D( Show( stderr ); )
+        loff_t  src = aSrcOffset;
+        loff_t  dst = aDstOffset;
+
+        while( aLen )
+        {
+            ssize_t n = copy_file_range( aSrcFd, &src, s.fd, &dst, aLen, 0 );
+
+            if( n <= 0 )
+                break;
+
+            aBuf += n;
+            aLen -= n;
+        }
+
+        if( !aLen )
+            return 0;
+
+        D( fprintf( stderr, "%s: no copy_file_range() into '%s': %s\n", __func__, s.name.c_str(), strerror( errno ) ); )
+        s.method = COPY_WRITE;
+        aDstOffset = dst;
     }
+#endif
 
-    void Show( FILE* fp )
+    while( aLen )
     {
-        fprintf( fp, "%s: name:%-20s start:0x%08x size:0x%08x\n",
-            __func__,
-            name.c_str(), sector_start, sector_count );
-    }
-};
+        ssize_t n = pwrite( s.fd, aBuf, aLen, aDstOffset );
 
+        if( n <= 0 )
+        {
+            *aError = "error writing file '" + s.name + "': " + strerror( errno );
+            return -1;
+        }
 
-typedef std::vector<PACKAGE>    PACKAGES_BASE;
-typedef std::vector<PARTITION>  PARTITIONS_BASE;
+        aBuf += n;
+        aLen -= n;
+        aDstOffset += n;
+    }
 
-PARTITION FirstPartition( "parameter", 0, 0x2000 );
+    return 0;
+}
 
 
 /**
- * Struct PARAMETERS
- * holds stuff from the parameter file.
+ * Function copy_range
+ * puts aLen bytes, found at aSrcOffset in file aSrcFd and also at aBuf in
+ * memory, into aSink at aDstOffset.  Cloning the extents is tried first, then
+ * a copy inside the kernel, then a plain write of aBuf.  Once a method fails
+ * for a sink it is not tried again there.  Clones also need block aligned
+ * ranges; unaligned ones go straight to the next method.  Safe to call from
+ * several threads for disjoint ranges.  Errors are returned in *aError rather
+ * than printed, so the caller can report them in order.
+ *
+ * The sink must read as zeros where nothing was written yet, like a freshly
+ * truncated file: ZERO_BLOCKs of zeros in aBuf, counted from aDstOffset's
+ * block boundary, are not copied but left as holes in the output.
  */
-struct PARAMETERS
+static int copy_range( COPY_SINK& aSink, int aSrcFd, uint64_t aSrcOffset,
+        const char* aBuf, uint64_t aLen, uint64_t aDstOffset, std::string* aError )
 {
-    unsigned        version;
-
-    std::string     machine_model;
-    std::string     machine_id;
-    std::string     manufacturer;
+    COPY_SINK& s = aSink;
 
-    void Show( FILE* fp )
+#if defined(FICLONERANGE)
+    // a clone shares the source's holes as well as its data
+    if( s.method == COPY_CLONE &&
+        aSrcOffset % s.blksize == 0 && aDstOffset % s.blksize == 0 && aLen % s.blksize == 0 )
     {
-        fprintf( fp, "version:%d.%d.%d  machine:%s  mfg:%s\n",
-            version >> 24,  0xff & (version >> 16),  0xffff & version,
-            machine_model.c_str(),
-            manufacturer.c_str()
-            );
-    }
-};
-
+        struct file_clone_range r;
 
-struct PACKAGES : public PACKAGES_BASE      // a std::vector
-{
-    int GetPackages( const char* package_file );
+        r.src_fd      = aSrcFd;
+        r.src_offset  = aSrcOffset;
+        r.src_length  = aLen;
+        r.dest_offset = aDstOffset;
 
-    void Show( FILE* fp )
-    {
-        fprintf( fp, "num_packages:%zu\n", size() );
+        if( ioctl( s.fd, FICLONERANGE, &r ) == 0 )
+            return 0;
 
-        for( unsigned i=0; i < size();  ++i )
-            (*this)[i].Show( fp );
+        D( fprintf( stderr, "%s: no cloning into '%s': %s\n", __func__, s.name.c_str(), strerror( errno ) ); )
+        s.method = COPY_RANGE;
     }
+#endif
 
-    PACKAGE* FindByName( const std::string& aName )
+    uint64_t    run = 0;        // start of the data not yet copied
+    uint64_t    pos = 0;
+
+    while( pos < aLen )
     {
-        for( unsigned i = 0; i < size(); ++i )
+        uint64_t n = std::min<uint64_t>( aLen - pos, ZERO_BLOCK - ( aDstOffset + pos ) % ZERO_BLOCK );
+
+        if( n == ZERO_BLOCK && all_zero( aBuf + pos, n ) )
         {
-            PACKAGE* pack = &(*this)[i];
+            if( run < pos &&
+                copy_run( s, aSrcFd, aSrcOffset + run, aBuf + run, pos - run, aDstOffset + run, aError ) )
+                return -1;
 
-            if( pack->name == aName )
-                return pack;
+            run = pos + n;
         }
 
-        return NULL;
+        pos += n;
     }
-};
 
+    if( run < aLen )
+        return copy_run( s, aSrcFd, aSrcOffset + run, aBuf + run, aLen - run, aDstOffset + run, aError );
 
-struct PARTITIONS : public PARTITIONS_BASE  // a std::vector
-{
-    void Show( FILE* fp )
-    {
-        fprintf( fp, "num_partitions:%zu\n", size() );
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// image headers
+
+/**
+ * Struct IMAGE
+ * is the header of an image file in the shape of the extended container,
+ * whichever of the two formats the file has, so that pack and unpack need
+ * not care beyond reading and writing it.
+ */
+struct IMAGE
+{
+    UPDATE_HEADER64             head;
+    std::vector<UPDATE_PART64>  parts;
+    bool                        extended;       // RKAX in the file, else RKAF
+    bool                        has_crcs;       // parts[].crc are known
+
+    IMAGE( bool aExtended = false ) :
+        extended( aExtended ),
+        has_crcs( false )
+    {
+        memset( &head, 0, sizeof(head) );
+    }
+
+    /// bytes the header takes at the start of the file
+    uint64_t HeaderSize() const
+    {
+        return extended ? sizeof(head) + parts.size() * sizeof(UPDATE_PART64) : sizeof(UPDATE_HEADER);
+    }
+
+    bool Fits( std::string* aError ) const;
+    std::vector<char> Bytes() const;
+    int Read( FILE* fp, uint32_t* aCrc );
+};
+
+
+/**
+ * Function IMAGE::Fits
+ * returns true if the image can be written in its format.  If not, *aError
+ * says why.
+ */
+bool IMAGE::Fits( std::string* aError ) const
+{
+    const uint64_t  max = uint32_t(~0);
+
+    if( extended )
+        return true;
+
+    if( parts.size() > 16 )
+    {
+        *aError = "more than 16 partitions need the extended format, -ext";
+        return false;
+    }
+
+    if( head.length > max )
+    {
+        *aError = "an image past 4 gbytes needs the extended format, -ext";
+        return false;
+    }
+
+    for( unsigned i = 0; i < parts.size(); ++i )
+    {
+        if( parts[i].part_offset > max || parts[i].padded_size > max || parts[i].part_bytecount > max )
+        {
+            *aError = std::string( "partition '" ) + parts[i].name + "' past 4 gbytes needs the extended format, -ext";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * Function IMAGE::Bytes
+ * returns the header as it goes into the file: an UPDATE_HEADER, with the
+ * part CRCs as a PART_CRCS table if known, or an UPDATE_HEADER64 followed by
+ * its UPDATE_PART64s.  Only meaningful if Fits().
+ */
+std::vector<char> IMAGE::Bytes() const
+{
+    std::vector<char>   bytes( HeaderSize() );
+
+    if( extended )
+    {
+        UPDATE_HEADER64 h = head;
+
+        memcpy( h.magic, RKAX_MAGIC, sizeof(h.magic) );
+        h.format    = RKAX_VERSION;
+        h.num_parts = parts.size();
+        h.flags     = has_crcs ? RKAX_PART_CRCS : 0;
+
+        memcpy( &bytes[0], &h, sizeof(h) );
+
+        if( parts.size() )
+            memcpy( &bytes[sizeof(h)], &parts[0], parts.size() * sizeof(UPDATE_PART64) );
+
+        return bytes;
+    }
+
+    UPDATE_HEADER&  h = *(UPDATE_HEADER*) &bytes[0];
+
+    memcpy( h.magic, RKAFP_MAGIC, sizeof(h.magic) );
+    h.length   = head.length;
+    memcpy( h.model, head.model, sizeof(h.model) );
+    memcpy( h.id, head.id, sizeof(h.id) );
+    memcpy( h.manufacturer, head.manufacturer, sizeof(h.manufacturer) );
+    h.unknown1  = head.unknown1;
+    h.version   = head.version;
+    h.num_parts = parts.size();
+
+    for( unsigned i = 0; i < parts.size() && i < 16; ++i )
+    {
+        const UPDATE_PART64&    p = parts[i];
+        UPDATE_PART&            q = h.parts[i];
+
+        memcpy( q.name, p.name, sizeof(q.name) );
+        memcpy( q.fullpath, p.fullpath, sizeof(q.fullpath) );
+        q.flash_size     = p.flash_size;
+        q.part_offset    = p.part_offset;
+        q.flash_offset   = p.flash_offset;
+        q.padded_size    = p.padded_size;
+        q.part_bytecount = p.part_bytecount;
+    }
+
+    if( has_crcs )
+    {
+        PART_CRCS* t = (PART_CRCS*) h.reserved;
+
+        memcpy( t->magic, PART_CRCS_MAGIC, sizeof(t->magic) );
+        t->version = PART_CRCS_VERSION;
+
+        for( unsigned i = 0; i < parts.size() && i < 16; ++i )
+            t->crc[i] = parts[i].crc;
+    }
+
+    return bytes;
+}
+
+
+/**
+ * Function IMAGE::Read
+ * reads the header of either format from fp, which is left just past it, and
+ * puts the CRC of the header's bytes into *aCrc.
+ *
+ * @return int - 0 if OK, -5 if the header can't be read, -6 for a bad magic.
+ */
+int IMAGE::Read( FILE* fp, uint32_t* aCrc )
+{
+    char    magic[4];
+
+    if( fread( magic, 1, sizeof(magic), fp ) != sizeof(magic) )
+        return -5;
+
+    if( memcmp( magic, RKAX_MAGIC, sizeof(magic) ) == 0 )
+    {
+        memcpy( head.magic, magic, sizeof(magic) );
+
+        if( fread( (char*) &head + sizeof(magic), 1, sizeof(head) - sizeof(magic), fp ) != sizeof(head) - sizeof(magic) )
+            return -5;
+
+        if( head.format != RKAX_VERSION || head.num_parts > 4096 )
+            return -6;
+
+        parts.resize( head.num_parts );
+
+        if( head.num_parts &&
+            fread( &parts[0], sizeof(UPDATE_PART64), parts.size(), fp ) != parts.size() )
+            return -5;
+
+        *aCrc = rkcrc_update( 0, &head, sizeof(head) );
+
+        if( parts.size() )
+            *aCrc = rkcrc_update( *aCrc, &parts[0], parts.size() * sizeof(UPDATE_PART64) );
+
+        extended = true;
+        has_crcs = head.flags & RKAX_PART_CRCS;
+        return 0;
+    }
+
+    if( memcmp( magic, RKAFP_MAGIC, sizeof(magic) ) )
+        return -6;
+
+    UPDATE_HEADER   h;
+
+    memcpy( h.magic, magic, sizeof(magic) );
+
+    if( fread( (char*) &h + sizeof(magic), 1, sizeof(h) - sizeof(magic), fp ) != sizeof(h) - sizeof(magic) )
+        return -5;
+
+    const PART_CRCS* table = part_crcs( h );
+
+    *aCrc = rkcrc_update( 0, &h, sizeof(h) );
+
+    memset( &head, 0, sizeof(head) );
+    memcpy( head.magic, magic, sizeof(magic) );
+    head.length    = h.length;
+    memcpy( head.model, h.model, sizeof(head.model) );
+    memcpy( head.id, h.id, sizeof(head.id) );
+    memcpy( head.manufacturer, h.manufacturer, sizeof(head.manufacturer) );
+    head.unknown1  = h.unknown1;
+    head.version   = h.version;
+    head.num_parts = std::min<uint32_t>( h.num_parts, 16 );
+
+    parts.resize( head.num_parts );
+
+    for( unsigned i = 0; i < parts.size(); ++i )
+    {
+        const UPDATE_PART&  q = h.parts[i];
+        UPDATE_PART64&      p = parts[i];
+
+        memset( &p, 0, sizeof(p) );
+        memcpy( p.name, q.name, sizeof(p.name) );
+        memcpy( p.fullpath, q.fullpath, sizeof(p.fullpath) );
+        p.flash_size     = q.flash_size;
+        p.flash_offset   = q.flash_offset;
+        p.crc            = table ? table->crc[i] : 0;
+        p.part_offset    = q.part_offset;
+        p.padded_size    = q.padded_size;
+        p.part_bytecount = q.part_bytecount;
+    }
+
+    extended = false;
+    has_crcs = table != NULL;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// unpack functions
+
+int create_dir( char* dir )
+{
+    char* sep = dir;
+
+    while( *sep && ( sep = strchr( sep, '/' ) ) != NULL )
+    {
+        if( sep == dir )        // an absolute path was passed.
+            ++sep;
+        else
+        {
+            *sep = '\0';
+
+            if( mkdir( dir, 0755 ) != 0 && errno != EEXIST )
+            {
+                fprintf( stderr, "%s: can't create directory: %s\n", __func__, dir );
+                return -1;
+            }
+
+            *sep++ = '/';
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Struct EXTRACT
+ * is one partition file being unpacked.  It is written under a temporary name
+ * and only renamed into place once the CRC of the whole image has checked out.
+ */
+struct EXTRACT : public COPY_SINK
+{
+    std::string     path;           // final file name
+    std::string     tmp_path;       // written here in the meantime
+    uint64_t        offset;         // of the partition within the image
+    uint64_t        len;
+
+    EXTRACT( const std::string& aPath, uint64_t aOffset, uint64_t aLen ) :
+        path( aPath ),
+        tmp_path( aPath + ".tmp" ),
+        offset( aOffset ),
+        len( aLen )
+    {
+        name = tmp_path;
+    }
+
+    /// creates the temporary file at its full size, all one hole for copy_range() to fill.
+    int Open()
+    {
+        SetFd( open( tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ) );
+
+        if( fd != -1 && ftruncate( fd, len ) )
+        {
+            close( fd );
+            fd = -1;
+        }
+
+        return fd;
+    }
+};
+
+// a deque because EXTRACTs, with their atomic member, can be built in place but not moved.
+typedef std::deque<EXTRACT>     EXTRACTS;
+
+
+/**
+ * Function finish_extracts
+ * closes all temporary files and then either renames them to their final
+ * names, if aKeep, or removes them.
+ */
+static int finish_extracts( EXTRACTS& aExtracts, bool aKeep )
+{
+    int ret = 0;
+
+    for( unsigned i = 0; i < aExtracts.size(); ++i )
+    {
+        EXTRACT& e = aExtracts[i];
+
+        if( e.fd != -1 && close( e.fd ) )
+        {
+            fprintf( stderr, "%s: error writing file '%s': %s\n",
+                __func__, e.tmp_path.c_str(), strerror( errno ) );
+            aKeep = false;
+            ret = -1;
+        }
+
+        e.fd = -1;
+    }
+
+    for( unsigned i = 0; i < aExtracts.size(); ++i )
+    {
+        EXTRACT& e = aExtracts[i];
+
+        if( aKeep && rename( e.tmp_path.c_str(), e.path.c_str() ) )
+        {
+            fprintf( stderr, "%s: can't rename '%s' to '%s': %s\n",
+                __func__, e.tmp_path.c_str(), e.path.c_str(), strerror( errno ) );
+            ret = -1;
+        }
+        else if( !aKeep )
+            unlink( e.tmp_path.c_str() );
+    }
+
+    return ret;
+}
+
+
+/**
+ * Function unpack_pass
+ * reads the aRanges of image file aFd with chunked_crc(), computing the CRC
+ * of each into aCrcs and handing the byte range of every EXTRACT to
+ * copy_range() as the range goes by.  So checking and extracting an image
+ * costs one read of it, and the extraction itself may not even have to copy
+ * the data.  Holes in the image stay holes in the extracted files.  Pieces
+ * are extracted concurrently, since partitions never share output bytes.
+ */
+static int unpack_pass( int aFd, const std::vector<RANGE>& aRanges, EXTRACTS& aExtracts,
+        std::vector<uint32_t>* aCrcs )
+{
+    std::string error;
+
+    int ret = chunked_crc( aFd, aRanges, aCrcs, &error,
+        [&]( uint64_t aPos, const char* aData, size_t aLen, std::string* aError )
+    {
+        for( unsigned x = 0; x < aExtracts.size(); ++x )
+        {
+            EXTRACT&    e = aExtracts[x];
+            uint64_t    from = std::max( aPos, e.offset );
+            uint64_t    to   = std::min( aPos + aLen, e.offset + e.len );
+
+            if( from < to &&
+                copy_range( e, aFd, from, &aData[from - aPos], to - from,
+                            from - e.offset, aError ) )
+            {
+                return false;
+            }
+        }
+
+        return true;
+    } );
+
+    if( ret )
+        fprintf( stderr, "%s: image %s\n", __func__, error.c_str() );
+
+    return ret;
+}
+
+
+/**
+ * Function unpack_stream
+ * is unpack_pass() for an image which can only be read front to back, such as
+ * a pipe.  The bytes of fp from aPos, where the header ended, up to aLen are
+ * read in order, continuing *aCrc over them and handing every EXTRACT its
+ * range as it goes by.  The trailing CRC which follows is put in *aCrcRead.
+ */
+static int unpack_stream( FILE* fp, uint64_t aPos, uint64_t aLen, EXTRACTS& aExtracts,
+        uint32_t* aCrc, uint32_t* aCrcRead )
+{
+    std::vector<char>   buffer( 1024*1024 );
+    std::string         error;
+
+    // nothing to clone or copy from
+    for( unsigned x = 0; x < aExtracts.size(); ++x )
+        aExtracts[x].method = COPY_WRITE;
+
+    while( aPos < aLen )
+    {
+        size_t  ask = std::min<uint64_t>( aLen - aPos, buffer.size() );
+        size_t  got = fread( &buffer[0], 1, ask, fp );
+
+        if( got != ask )
+        {
+            fprintf( stderr, "%s: image is shorter than its header says, ended at offset %" PRIu64 "\n",
+                __func__, aPos + got );
+            return -1;
+        }
+
+        *aCrc = crc_skip_zeros( *aCrc, &buffer[0], got );
+
+        for( unsigned x = 0; x < aExtracts.size(); ++x )
+        {
+            EXTRACT&    e = aExtracts[x];
+            uint64_t    from = std::max( aPos, e.offset );
+            uint64_t    to   = std::min( aPos + got, e.offset + e.len );
+
+            if( from < to &&
+                copy_range( e, -1, from, &buffer[from - aPos], to - from, from - e.offset, &error ) )
+            {
+                fprintf( stderr, "%s: %s\n", __func__, error.c_str() );
+                return -1;
+            }
+        }
+
+        aPos += got;
+    }
+
+    if( fread( aCrcRead, 1, sizeof(*aCrcRead), fp ) != sizeof(*aCrcRead) )
+    {
+        fprintf( stderr, "%s: image ends without its CRC\n", __func__ );
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Function image_crc
+ * returns the CRC of an image of aImageLen bytes, not counting the CRC itself,
+ * from aHeaderCrc, the CRC of its header, and the known CRCs of the payloads
+ * of image.  Everything else in the image is taken to be zeros, which is how
+ * it is packed, so nothing needs to be read.
+ */
+static uint32_t image_crc( const IMAGE& image, uint32_t aHeaderCrc, uint64_t aImageLen )
+{
+    std::vector<const UPDATE_PART64*>   payloads;
+
+    for( unsigned i = 0; i < image.parts.size(); ++i )
+    {
+        const UPDATE_PART64& part = image.parts[i];
+
+        if( part.part_bytecount && strcmp( part.fullpath, "SELF" ) && strcmp( part.fullpath, "RESERVED" ) )
+            payloads.push_back( &part );
+    }
+
+    std::sort( payloads.begin(), payloads.end(),
+        []( const UPDATE_PART64* a, const UPDATE_PART64* b ) { return a->part_offset < b->part_offset; } );
+
+    uint32_t    crc = aHeaderCrc;
+    uint64_t    pos = image.HeaderSize();       // how far crc reaches
+
+    for( unsigned i = 0; i < payloads.size(); ++i )
+    {
+        const UPDATE_PART64& part = *payloads[i];
+
+        if( part.part_offset < pos )
+            continue;                           // shared with the one before
+
+        crc = rkcrc_zeros( crc, part.part_offset - pos );
+        crc = rkcrc_combine( crc, part.crc, part.part_bytecount );
+        crc = rkcrc_zeros( crc, part.padded_size - part.part_bytecount );
+
+        pos = part.part_offset + part.padded_size;
+    }
+
+    return rkcrc_zeros( crc, aImageLen - pos );
+}
+
+
+/**
+ * Function unpack_update
+ * extracts the partitions of image file srcfile, in either format, into
+ * directory dstdir, all of them or only those named in aNames, and checks
+ * them.  A NULL dstdir only checks.  Unless partitions are named, the whole
+ * image is read and checked against its trailing CRC, and partition CRCs, if
+ * the image has them, must add up to that same CRC.  When only some
+ * partitions are named and the image has partition CRCs, only those are read
+ * and each is checked against its own CRC, all in parallel.  A srcfile of "-" is stdin.  An image which can't be seeked in
+ * is read front to back with unpack_stream() and checked against its
+ * trailing CRC at the end.
+ */
+int unpack_update( const char* srcfile, const char* dstdir, const std::vector<std::string>& aNames )
+{
+    int ret = 0;
+
+    IMAGE                   image;
+    off_t                   filesize;
+    struct stat             st;
+    bool                    seekable;
+    bool                    check_crc = false;
+    bool                    per_part = false;
+    uint32_t                crc_read = 0;
+    uint32_t                head_crc;
+    EXTRACTS                extracts;
+    std::vector<RANGE>      ranges;
+    std::vector<unsigned>   range_part;     // which partition each range is the record of
+    std::vector<uint32_t>   crcs;
+
+    FILE* fp = strcmp( srcfile, "-" ) ? fopen( srcfile, "rb" ) : stdin;
+
+    if( !fp )
+    {
+        fprintf( stderr, "%s: can't open file '%s'", __func__, srcfile );
+        ret = -4;
+        goto out;
+    }
+
+    seekable = fstat( fileno( fp ), &st ) == 0 && ( S_ISREG( st.st_mode ) || S_ISBLK( st.st_mode ) );
+
+    ret = image.Read( fp, &head_crc );
+
+    if( ret == -5 )
+    {
+        fprintf( stderr, "%s: can't read image header from file '%s'", __func__, srcfile );
+        goto out;
+    }
+
+    if( ret )
+    {
+        fprintf( stderr, "%s: invalid header magic id in file '%s'", __func__, srcfile );
+        goto out;
+    }
+
+    if( !seekable )
+        check_crc = true;       // against the CRC at the end of the stream
+    else
+    {
+        fseeko( fp, 0, SEEK_END );
+
+        filesize = ftello(fp);
+
+        if( uint64_t( filesize ) - 4 != image.head.length )
+        {
+            fprintf( stderr,
+                "%s: update_header.length cannot be correct, cannot check CRC\n",
+                __func__
+                );
+        }
+        else
+        {
+            fseeko( fp, image.head.length, SEEK_SET );
+
+            unsigned readcount;
+
+            readcount = fread( &crc_read, 1, sizeof(crc_read), fp );
+
+            if( sizeof(crc_read) != readcount )
+            {
+                fprintf( stderr, "Can't read crc checksum, readcount=%d header.len=%" PRIu64 "\n",
+                    readcount, image.head.length );
+            }
+            else
+                check_crc = true;
+        }
+    }
+
+    // the header and the gaps between payloads are only covered by the
+    // trailing CRC, so only skip them when some partitions are asked for
+    per_part = seekable && image.has_crcs && !aNames.empty();
+
+    printf( "------- %s %zu partitions -------\n", dstdir ? "UNPACKING" : "CHECKING", image.parts.size() );
+
+    for( unsigned i = 0; i < aNames.size(); ++i )
+    {
+        unsigned x = 0;
+
+        while( x < image.parts.size() && aNames[i] != std_string( image.parts[x].name, sizeof(image.parts[x].name) ) )
+            ++x;
+
+        if( x == image.parts.size() )
+        {
+            fprintf( stderr, "%s: no partition '%s' in file '%s'\n", __func__, aNames[i].c_str(), srcfile );
+            ret = -3;
+            goto out;
+        }
+    }
+
+    if( image.parts.size() )
+    {
+        char dir[4096];
+
+        for( unsigned i = 0; i < image.parts.size(); i++ )
+        {
+            UPDATE_PART64* part = &image.parts[i];
+
+            printf( "%-60s0x%08" PRIx64 "  0x%08" PRIx64,
+                    std_string( part->fullpath, sizeof( part->fullpath ) ).c_str(),
+                    part->part_offset,
+                    part->part_bytecount
+                    );
+
+            printf( "\n" );
+
+            if( !aNames.empty() &&
+                std::find( aNames.begin(), aNames.end(), std_string( part->name, sizeof(part->name) ) ) == aNames.end() )
+                continue;
+
+            if( !strcmp( part->fullpath, "SELF" ) )
+            {
+                printf( "Skipping SELF partition file.\n" );
+                continue;
+            }
+
+            if( !strcmp( part->fullpath, "RESERVED" ) )
+            {
+                printf( "Skipping RESERVED partition file.\n" );
+                continue;
+            }
+
+            if( part->part_bytecount > image.head.length ||
+                part->part_offset > image.head.length - part->part_bytecount )
+            {
+                fprintf( stderr, "%s: partition record: '%s' has a length too long for envelop\n",
+                    __func__,
+                    std_string( part->name, sizeof( part->name ) ).c_str()
+                    );
+                ret = -2;
+                break;
+            }
+
+            if( per_part )
+            {
+                RANGE r = { part->part_offset, part->part_bytecount };
+
+                ranges.push_back( r );
+                range_part.push_back( i );
+            }
+
+            if( !dstdir )
+                continue;
+
+            uint64_t offset = part->part_offset;
+            uint64_t len    = part->part_bytecount;
+
+            if( memcmp( part->name, "parameter", 9 ) == 0 )
+            {
+                if( len < sizeof(PARAM_HEADER) + 4 )
+                {
+                    fprintf( stderr, "%s: partition record: '%s' is too short for a parameter block\n",
+                        __func__,
+                        std_string( part->name, sizeof( part->name ) ).c_str()
+                        );
+                    ret = -2;
+                    break;
+                }
+
+                offset += sizeof(PARAM_HEADER);
+                len    -= sizeof(PARAM_HEADER) + 4;    // CRC + PARM_HEADER
+            }
+
+            if( offset + len > image.head.length )
+            {
+                fprintf( stderr, "%s: partition record: '%s' has a length too long for envelop\n",
+                    __func__,
+                    std_string( part->name, sizeof( part->name ) ).c_str()
+                    );
+                ret = -2;
+                break;
+            }
+
+            snprintf( dir, sizeof(dir), "%s/%s", dstdir,
+                std_string( part->fullpath, sizeof( part->fullpath ) ).c_str() );
+
+            ret = create_dir( dir );
+            if( ret )
+                break;
+
+            // partitions sharing a file, like boot and recovery, write it once;
+            // the later partition wins, as when each was written in turn
+            EXTRACT* same = NULL;
+
+            for( unsigned x = 0; x < extracts.size() && !same; ++x )
+            {
+                if( extracts[x].path == dir )
+                    same = &extracts[x];
+            }
+
+            if( same )
+            {
+                same->offset = offset;
+                same->len    = len;
+
+                if( ftruncate( same->fd, 0 ) || ftruncate( same->fd, len ) )
+                {
+                    fprintf( stderr, "%s: can't size file: %s\n", __func__, same->tmp_path.c_str() );
+                    ret = -1;
+                    break;
+                }
+
+                continue;
+            }
+
+            extracts.emplace_back( dir, offset, len );
+
+            EXTRACT& e = extracts.back();
+
+            if( e.Open() == -1 )
+            {
+                fprintf( stderr, "%s: can't open/create file: %s\n", __func__, e.tmp_path.c_str() );
+                ret = -1;
+                break;
+            }
+        }
+
+        printf( "\n" );
+    }
+
+    if( ret )
+    {
+        finish_extracts( extracts, false );
+        goto out;
+    }
+
+    if( !per_part )
+    {
+        RANGE r = { 0, image.head.length };
+
+        ranges.push_back( r );
+    }
+
+    if( per_part )
+        printf( "Checking partition CRCs for file '%s'%s...", srcfile, dstdir ? " while extracting" : "" );
+    else if( check_crc )
+        printf( "Checking CRC for file '%s'%s...", srcfile, dstdir ? " while extracting" : "" );
+    else if( dstdir )
+        printf( "Extracting from file '%s'...", srcfile );
+    else
+    {
+        fprintf( stderr, "%s: nothing to check in file '%s'\n", __func__, srcfile );
+        ret = -7;
+        goto out;
+    }
+
+    fflush( stdout );
+
+    if( seekable )
+        ret = unpack_pass( fileno( fp ), ranges, extracts, &crcs );
+    else
+    {
+        crcs.assign( 1, head_crc );
+        ret = unpack_stream( fp, image.HeaderSize(), image.head.length, extracts, &crcs[0], &crc_read );
+    }
+
+    if( !ret && per_part )
+    {
+        for( unsigned r = 0; r < ranges.size(); ++r )
+        {
+            const UPDATE_PART64& part = image.parts[range_part[r]];
+
+            if( crcs[r] != part.crc )
+            {
+                fprintf( stderr,
+                    "CRC_table:0x%08x CRC_calc:0x%08x mismatch in partition '%s' of file '%s'%s\n",
+                    part.crc,
+                    crcs[r],
+                    std_string( part.name, sizeof(part.name) ).c_str(),
+                    srcfile,
+                    dstdir ? ", nothing extracted" : ""
+                    );
+                ret = -7;
+            }
+        }
+    }
+    else if( !ret && check_crc && crcs[0] != crc_read )
+    {
+        fprintf( stderr,
+            "CRC_file:0x%08x CRC_calc:0x%08x mismatch in file '%s'%s\n",
+            crc_read,
+            crcs[0],
+            srcfile,
+            dstdir ? ", nothing extracted" : ""
+            );
+        ret = -7;
+    }
+    else if( !ret && check_crc && image.has_crcs &&
+             image_crc( image, head_crc, image.head.length ) != crc_read )
+    {
+        fprintf( stderr,
+            "CRC_file:0x%08x CRC_table:0x%08x partition CRCs don't add up to the CRC of file '%s'%s\n",
+            crc_read,
+            image_crc( image, head_crc, image.head.length ),
+            srcfile,
+            dstdir ? ", nothing extracted" : ""
+            );
+        ret = -7;
+    }
+
+    if( finish_extracts( extracts, !ret ) && !ret )
+        ret = -1;
+
+    if( !ret )
+        printf( "OK\n\n" );
+
+out:
+    if( fp && fp != stdin )
+        fclose( fp );
+
+    return ret;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// pack functions
+
+struct PACKAGE
+{
+    std::string     name;
+    std::string     fullpath;
+
+    PACKAGE( const char* aName = "", const char* aPath = "" ) :
+        name( aName ),
+        fullpath( aPath )
+    {
+    }
+
+    void Show( FILE* fp )
+    {
+        fprintf( fp, "name:%-34s  fullpath:%s\n",
+            name.c_str(), fullpath.c_str() );
+    }
+};
+
+
+struct PARTITION
+{
+    std::string     name;
+    unsigned        sector_start;   // at what starting sector (sector=512)
+    unsigned        sector_count;   // how many 512 sectors
+
+    PARTITION( const std::string& aName = "", unsigned aSectorStart = 0, unsigned aSectorCount = 0 ) :
+        name( aName ),
+        sector_start( aSectorStart ),
+        sector_count( aSectorCount )
+    {
+        D( Show( stderr ); )
+    }
+
+    void Show( FILE* fp )
+    {
+        fprintf( fp, "%s: name:%-20s start:0x%08x size:0x%08x\n",
+            __func__,
+            name.c_str(), sector_start, sector_count );
+    }
+};
+
+
+typedef std::vector<PACKAGE>    PACKAGES_BASE;
+typedef std::vector<PARTITION>  PARTITIONS_BASE;
+
+PARTITION FirstPartition( "parameter", 0, 0x2000 );
+
+
+/**
+ * Struct PARAMETERS
+ * holds stuff from the parameter file.
+ */
+struct PARAMETERS
+{
+    unsigned        version;
+
+    std::string     machine_model;
+    std::string     machine_id;
+    std::string     manufacturer;
+
+    void Show( FILE* fp )
+    {
+        fprintf( fp, "version:%d.%d.%d  machine:%s  mfg:%s\n",
+            version >> 24,  0xff & (version >> 16),  0xffff & version,
+            machine_model.c_str(),
+            manufacturer.c_str()
+            );
+    }
+};
+
+
+struct PACKAGES : public PACKAGES_BASE      // a std::vector
+{
+    int GetPackages( const char* package_file );
+
+    void Show( FILE* fp )
+    {
+        fprintf( fp, "num_packages:%zu\n", size() );
+
+        for( unsigned i=0; i < size();  ++i )
+            (*this)[i].Show( fp );
+    }
+
+    PACKAGE* FindByName( const std::string& aName )
+    {
+        for( unsigned i = 0; i < size(); ++i )
+        {
+            PACKAGE* pack = &(*this)[i];
+
+            if( pack->name == aName )
+                return pack;
+        }
+
+        return NULL;
+    }
+};
+
+
+struct PARTITIONS : public PARTITIONS_BASE  // a std::vector
+{
+    void Show( FILE* fp )
+    {
+        fprintf( fp, "num_partitions:%zu\n", size() );
+
+        for( unsigned i=0;  i < size();  ++i )
+            (*this)[i].Show( fp );
+    }
+
+    PARTITION* FindByName( const std::string& aName )
+    {
+        for( unsigned i=0;  i < size();  ++i )
+        {
+            PARTITION* part = &(*this)[i];
+
+            if( part->name == aName )
+                return part;
+        }
+
+        if( aName ==  FirstPartition.name )
+        {
+            return &FirstPartition;
+        }
+
+        return NULL;
+    }
+
+    int Parse( char* str );
+};
+
+
+PARAMETERS  Parameters;
+
+PACKAGES    Packages;
+
+PARTITIONS  Partitions;
+
+
+int PARTITIONS::Parse( char* str )
+{
+    clear();
+
+    char*   parts = strchr( str, ':' );
+
+    if( parts )
+    {
+        char*   token1 = NULL;
+
+        ++parts;
+
+        char* tok = strtok_r( parts, ",", &token1 );
+
+        for( ; tok; tok = strtok_r( NULL, ",", &token1 ) )
+        {
+            char*    ptr;
+            unsigned sector_count = strtoul( tok, &ptr, 0 );
+
+            ptr = strchr( ptr, '@' );
+
+            if( !ptr )
+                continue;
+
+            ++ptr;
+
+            unsigned sector_start = strtoul( ptr, &ptr, 0 );
+
+            for( ; *ptr && *ptr != '('; ptr++ )
+                ;
+
+            ++ptr;
+
+            char* name_start = ptr;
+
+            int i;
+            for( i = 0; i < sizeof( ((PARTITION*)0)->name) && *ptr && *ptr != ')'; ++i )
+                ++ptr;
+
+            std::string name( name_start, i );
+
+            Partitions.push_back( PARTITION( name, sector_start, sector_count ) );
+        }
+    }
+
+    return 0;
+}
+
+
+int action_parse_key( char* key, char* value )
+{
+    int ret = 0;
+
+    if( strcmp( key, "FIRMWARE_VER" ) == 0 )
+    {
+        unsigned a, b, c;
+
+        sscanf( value, "%d.%d.%d", &a, &b, &c );
+        Parameters.version = ROM_VERSION( a, b, c );
+    }
+    else if( strcmp( key, "MACHINE_MODEL" ) == 0 )
+    {
+        Parameters.machine_model = value;
+    }
+    else if( strcmp( key, "MACHINE_ID" ) == 0 )
+    {
+        Parameters.machine_id = value;
+    }
+    else if( strcmp( key, "MANUFACTURER" ) == 0 )
+    {
+        Parameters.manufacturer = value;
+    }
+    else if( strcmp( key, "CMDLINE" ) == 0 )
+    {
+        char*   token1 = NULL;
+        char*   param = strtok_r( value, " ", &token1 );
+
+        while( param )
+        {
+            char*   param_key = param;
+            char*   param_value = strchr( param, '=' );
+
+            if( param_value )
+            {
+                *param_value++ = '\0';
+
+                if( strcmp( param_key, "mtdparts" ) == 0 )
+                {
+                    ret = Partitions.Parse( param_value );
+                }
+            }
+
+            param = strtok_r( NULL, " ", &token1 );
+        }
+    }
+
+    return ret;
+}
+
+
+int parse_parameter( const char* fname )
+{
+    int     ret = 0;
+    char    line[4096];
+
+    FILE*   fp = fopen( fname, "r" );
+
+    if( !fp )
+    {
+        printf( "Can't open file: %s\n", fname );
+        return -1;
+    }
+
+    while( fgets( line, sizeof(line), fp ) != NULL )
+    {
+        char*   startp = line;
+        char*   endp   = line + strlen( line ) - 1;
+
+        // skip UTF-8 BOM only in first line
+        if( startp[0] == (char)0xEF && startp[1] == (char)0xBB && startp[2] == (char)0xBF)
+            startp += 3;
+
+        if( *endp != '\n' && *endp != '\r' && !feof( fp ) )
+        {
+            fprintf( stderr, "parameter file has a very long line that I cannot handle!\n" );
+            ret = -3;
+            break;
+        }
+
+        while( endp > startp && isspace( *endp ) )
+            *endp-- = 0;
+
+        // trim line
+        while( *startp && isspace( *startp ) )
+            ++startp;
+
+        if( *startp == '#' || *startp == 0 )
+            continue;
+
+        char*   key   = startp;
+        char*   value = strchr( startp, ':' );
+
+        if( !value )
+            continue;
+
+        *value++ = 0;
+
+        while( *value && isspace( *value ) )
+            ++value;
+
+        action_parse_key( key, value );
+    }
+
+    if( fp )
+        fclose( fp );
+
+    return ret;
+}
+
+
+int PACKAGES::GetPackages( const char* fname )
+{
+    int     ret = 0;
+    char    line[4096];
+
+    clear();
+
+    FILE*   fp = fopen( fname, "r" );
+
+    if( !fp )
+    {
+        fprintf( stderr, "%s: can't open file '%s'\n", __func__, fname );
+        fprintf( stderr, "Every project needs a 'package-list' file in the source directory\n" );
+        return -1;
+    }
+
+    while( fgets( line, sizeof(line), fp ) != NULL )
+    {
+        char*   startp = line;
+        char*   endp = line + strlen( line ) - 1;
+
+        if( *endp != '\n' && *endp != '\r' && !feof( fp ) )
+        {
+            fprintf( stderr,
+                "File '%s' has a line which is too long for me, sorry!\n", fname );
+            ret = -3;
+            break;
+        }
+
+        // trim line
+        while( isspace( *startp ) )
+            ++startp;
+
+        while( isspace( *endp ) )
+            --endp;
+
+        endp[1] = 0;
+
+        if( *startp == '#' || *startp == 0 )
+            continue;
+
+        char* name = startp;
+
+        while( *startp && *startp != ' ' && *startp != '\t' )
+            startp++;
+
+        while( *startp == ' ' || *startp == '\t' )
+        {
+            *startp = '\0';
+            startp++;
+        }
+
+        char* path = startp;
+
+        push_back( PACKAGE( name, path ) );
+    }
+
+    fclose( fp );
+
+    return ret;
+}
+
+
+// size of the parameter partition within the image, and the multiple every
+// other partition is padded to.
+#define PART_BLOCK      2048
+
+/// boundary every partition's payload starts on, a power of two, at least PART_BLOCK
+unsigned    Align = PART_BLOCK;
+
+/// aPos rounded up to the next multiple of Align
+static uint64_t align_up( uint64_t aPos )
+{
+    return (aPos + Align - 1) & ~uint64_t( Align - 1 );
+}
+
+
+/**
+ * Function put_zeros
+ * appends aCount zero bytes to fp, continuing *aCrc over them.
+ */
+static void put_zeros( FILE* fp, uint64_t aCount, uint32_t* aCrc )
+{
+    static const char zeros[PART_BLOCK] = {};
+
+    *aCrc = rkcrc_zeros( *aCrc, aCount );
+
+    while( aCount )
+    {
+        size_t n = std::min<uint64_t>( aCount, sizeof(zeros) );
+
+        fwrite( zeros, 1, n, fp );
+        aCount -= n;
+    }
+}
+
+
+/**
+ * Struct SOURCE
+ * is where the payload of one partition comes from: a whole file, or the
+ * data of one member of an uncompressed tar archive, read in place.
+ */
+struct SOURCE
+{
+    std::string     path;           // file to read, empty for SELF and RESERVED
+    std::string     member;         // name within path if that is a tar archive
+    uint64_t        offset;         // of the payload within path
+    uint64_t        len;            // of the payload, only for a member
+
+    // unused extents of the payload which are taken as zeros, start to end
+    std::map<uint64_t, uint64_t>    unused;
+
+    SOURCE( const std::string& aPath = "" ) :
+        path( aPath ),
+        offset( 0 ),
+        len( 0 )
+    {
+    }
+
+    bool empty() const      { return path.empty(); }
+    void clear()            { *this = SOURCE(); }
+
+    /// for messages
+    std::string Name() const
+    {
+        return member.empty() ? path : path + ":" + member;
+    }
+
+    /// the length of the payload, given the stat() of path
+    uint64_t Size( const struct stat& aStat ) const
+    {
+        return member.empty() ? uint64_t( aStat.st_size ) : len;
+    }
+
+    /// the end of the unused extent holding aPos of the payload, else aPos
+    uint64_t UnusedEnd( uint64_t aPos ) const
+    {
+        std::map<uint64_t, uint64_t>::const_iterator it = unused.upper_bound( aPos );
+
+        if( it == unused.begin() || (--it)->second <= aPos )
+            return aPos;
+
+        return it->second;
+    }
+
+    /// the start of the first unused extent after aPos of the payload, else ~0
+    uint64_t NextUnused( uint64_t aPos ) const
+    {
+        std::map<uint64_t, uint64_t>::const_iterator it = unused.upper_bound( aPos );
+
+        return it == unused.end() ? ~uint64_t(0) : it->first;
+    }
+
+    /// opens path positioned at the payload, or returns NULL
+    FILE* Open() const
+    {
+        FILE* fp = fopen( path.c_str(), "rb" );
+
+        if( fp && offset && fseeko( fp, offset, SEEK_SET ) )
+        {
+            fclose( fp );
+            fp = NULL;
+        }
+
+        return fp;
+    }
+};
+
+typedef std::vector<SOURCE>             SOURCES;
+typedef std::map<std::string, SOURCE>   TAR_MEMBERS;    // by member name
+
+
+/// Tar archive, -tar, whose members stand in for the partition files of src_dir.
+const char* TarFile = NULL;
+
+
+/**
+ * Function tar_number
+ * returns the value of a numeric tar header field: octal digits, or for big
+ * values the GNU base-256 form flagged by the top bit of the first byte.
+ */
+static uint64_t tar_number( const char* aField, size_t aLen )
+{
+    uint64_t v = 0;
+
+    if( aField[0] & 0x80 )
+    {
+        v = aField[0] & 0x3f;
+
+        for( size_t i = 1; i < aLen; ++i )
+            v = (v << 8) | (unsigned char) aField[i];
+
+        return v;
+    }
+
+    for( size_t i = 0; i < aLen && aField[i]; ++i )
+    {
+        if( aField[i] >= '0' && aField[i] <= '7' )
+            v = (v << 3) | (aField[i] - '0');
+    }
+
+    return v;
+}
+
+
+/**
+ * Function read_tar_index
+ * finds every regular file in tar archive aArchive and where its data is,
+ * without reading the data.  ustar, GNU long names and pax path and size
+ * records are understood.  A leading "./" is dropped from the names.
+ *
+ * @return int - 0 if OK, -1 if aArchive can't be read or is not a tar archive.
+ */
+static int read_tar_index( const char* aArchive, TAR_MEMBERS* aMembers )
+{
+    int fd = open( aArchive, O_RDONLY );
+
+    if( fd == -1 )
+    {
+        fprintf( stderr, "%s: can't open archive '%s': %s\n", __func__, aArchive, strerror( errno ) );
+        return -1;
+    }
+
+    int         ret = 0;
+    uint64_t    pos = 0;
+    std::string long_name;      // for the next member, from a GNU 'L' or pax record
+    int64_t     long_size = -1;
+    char        h[512];
+
+    while( pread( fd, h, sizeof(h), pos ) == sizeof(h) )
+    {
+        if( all_zero( h, sizeof(h) ) )
+            break;                          // end of archive
+
+        unsigned sum = 0;
+
+        for( unsigned i = 0; i < sizeof(h); ++i )
+            sum += ( i >= 148 && i < 156 ) ? ' ' : (unsigned char) h[i];
+
+        if( sum != tar_number( h + 148, 8 ) )
+        {
+            fprintf( stderr, "%s: '%s' is not an uncompressed tar archive\n", __func__, aArchive );
+            ret = -1;
+            break;
+        }
+
+        char        type = h[156];
+        uint64_t    size = tar_number( h + 124, 12 );
+        uint64_t    data = pos + sizeof(h);
+        std::string name;
+
+        if( type == 'L' || type == 'x' )
+        {
+            std::string text( size, '\0' );
+
+            if( size && pread( fd, &text[0], size, data ) != (ssize_t) size )
+            {
+                ret = -1;
+                break;
+            }
+
+            if( type == 'L' )
+                long_name = text.c_str();
+
+            // pax records are "<length> <key>=<value>\n"
+            for( size_t r = 0; type == 'x' && r < text.size(); )
+            {
+                size_t  reclen = strtoul( &text[r], NULL, 10 );
+                size_t  sp = text.find( ' ', r );
+
+                if( !reclen || sp == std::string::npos || r + reclen > text.size() )
+                    break;
+
+                std::string rec = text.substr( sp + 1, r + reclen - sp - 2 );
+
+                if( rec.compare( 0, 5, "path=" ) == 0 )
+                    long_name = rec.substr( 5 );
+                else if( rec.compare( 0, 5, "size=" ) == 0 )
+                    long_size = strtoull( rec.c_str() + 5, NULL, 10 );
+
+                r += reclen;
+            }
+
+            pos = data + (size + 511) / 512 * 512;
+            continue;
+        }
+
+        if( long_size >= 0 )
+            size = long_size;
+
+        if( !long_name.empty() )
+            name = long_name;
+        else
+        {
+            name = std_string( h, 100 );
+
+            if( memcmp( h + 257, "ustar", 5 ) == 0 && h[345] )
+                name = std_string( h + 345, 155 ) + "/" + name;
+        }
+
+        if( name.compare( 0, 2, "./" ) == 0 )
+            name.erase( 0, 2 );
+
+        if( type == '0' || type == '\0' )
+        {
+            SOURCE& m = (*aMembers)[name];
+
+            m.path   = aArchive;
+            m.member = name;
+            m.offset = data;
+            m.len    = size;
+        }
+
+        long_name.clear();
+        long_size = -1;
+        pos = data + (size + 511) / 512 * 512;
+    }
+
+    close( fd );
+
+    return ret;
+}
+
+
+/// Take the blocks an ext4 file system does not use as zeros, -ext4-free.
+bool Ext4Free = false;
+
+
+/// little endian fields of ext4 metadata, by byte offset
+static uint16_t ext4_u16( const char* aBuf, size_t aOffset )
+{
+    return (unsigned char) aBuf[aOffset] | (unsigned char) aBuf[aOffset+1] << 8;
+}
+
+static uint32_t ext4_u32( const char* aBuf, size_t aOffset )
+{
+    return ext4_u16( aBuf, aOffset ) | uint32_t( ext4_u16( aBuf, aOffset + 2 ) ) << 16;
+}
+
+
+/**
+ * Function ext4_has_super
+ * returns true if block group aGroup starts with a superblock and group
+ * descriptor backup, given the s_feature_ro_compat flags aRoCompat.
+ */
+static bool ext4_has_super( uint64_t aGroup, uint32_t aRoCompat )
+{
+    if( !( aRoCompat & 0x1 ) || aGroup <= 1 )        // !RO_COMPAT_SPARSE_SUPER
+        return true;
+
+    static const unsigned bases[] = { 3, 5, 7 };
+
+    for( unsigned b = 0; b < 3; ++b )
+    {
+        uint64_t n = aGroup;
+
+        while( n % bases[b] == 0 )
+            n /= bases[b];
+
+        if( n == 1 )
+            return true;
+    }
+
+    return false;
+}
+
+
+/**
+ * Function ext4_unused
+ * fills aSource->unused with the blocks which the block bitmaps of the ext4
+ * file system in its payload mark free, so they need neither be read nor
+ * stored.  A payload which is not ext4, or uses features whose layout is not
+ * understood here, is left alone.  Only the block bitmaps and the group
+ * descriptors are read.  Like the kernel, a group whose bitmap was never
+ * initialized is taken to hold just its own metadata.
+ *
+ * @return uint64_t - the number of unused bytes found.
+ */
+static uint64_t ext4_unused( SOURCE* aSource )
+{
+    struct stat st;
+    int         fd = open( aSource->path.c_str(), O_RDONLY );
+    char        sb[1024];
+    uint64_t    ret = 0;
+
+    if( fd == -1 )
+        return 0;
+
+    if( fstat( fd, &st ) || !S_ISREG( st.st_mode ) ||
+        pread( fd, sb, sizeof(sb), aSource->offset + 1024 ) != sizeof(sb) ||
+        ext4_u16( sb, 0x38 ) != 0xef53 || ext4_u32( sb, 0x18 ) > 6 )
+    {
+        close( fd );
+        return 0;
+    }
+
+    uint32_t    compat    = ext4_u32( sb, 0x5c );
+    uint32_t    incompat  = ext4_u32( sb, 0x60 );
+    uint32_t    ro_compat = ext4_u32( sb, 0x64 );
+    uint64_t    bs        = 1024u << ext4_u32( sb, 0x18 );
+    uint64_t    blocks    = ext4_u32( sb, 0x04 ) | ( incompat & 0x80 ? uint64_t( ext4_u32( sb, 0x150 ) ) << 32 : 0 );
+    uint64_t    first     = ext4_u32( sb, 0x14 );
+    uint64_t    bpg       = ext4_u32( sb, 0x20 );
+    uint64_t    ipg       = ext4_u32( sb, 0x28 );
+    uint64_t    isize     = ext4_u32( sb, 0x4c ) ? ext4_u16( sb, 0x58 ) : 128;
+    uint64_t    desc      = incompat & 0x80 ? ext4_u16( sb, 0xfe ) : 32;
+    uint64_t    rgdt      = ext4_u16( sb, 0xce );
+
+    // RECOVER: the bitmaps may be stale until the journal is replayed, META_BG
+    // and SPARSE_SUPER2 place descriptors and backups differently, BIGALLOC
+    // has a bitmap bit per cluster
+    if( ( incompat & ( 0x4 | 0x10 ) ) || ( compat & 0x200 ) || ( ro_compat & 0x200 ) ||
+        !bpg || bpg > bs * 8 || desc < 32 || blocks <= first ||
+        blocks * bs > aSource->Size( st ) )
+    {
+        close( fd );
+        return 0;
+    }
+
+    bool        uninit_ok = ro_compat & ( 0x10 | 0x400 );      // GDT_CSUM or METADATA_CSUM
+    uint64_t    groups = ( blocks - first + bpg - 1 ) / bpg;
+    uint64_t    gdt_blocks = ( groups * desc + bs - 1 ) / bs;
+    uint64_t    itable_blocks = ( ipg * isize + bs - 1 ) / bs;
+
+    std::vector<char>           gdt( groups * desc );
+    std::vector<unsigned char>  bitmap( bs );
+    std::map<uint64_t, uint64_t> unused;
+
+    if( pread( fd, &gdt[0], gdt.size(), aSource->offset + ( first + 1 ) * bs ) != (ssize_t) gdt.size() )
+        groups = 0;
+
+    for( uint64_t g = 0; g < groups; ++g )
+    {
+        const char* d     = &gdt[g * desc];
+        uint64_t    start = first + g * bpg;
+        uint64_t    count = std::min( bpg, blocks - start );
+        bool        hi    = desc >= 64;
+        uint64_t    block_bitmap = ext4_u32( d, 0x00 ) | ( hi ? uint64_t( ext4_u32( d, 0x20 ) ) << 32 : 0 );
+
+        if( uninit_ok && ( ext4_u16( d, 0x12 ) & 0x2 ) )     // BLOCK_UNINIT
+        {
+            uint64_t meta[3][2] = {
+                { block_bitmap, 1 },
+                { ext4_u32( d, 0x04 ) | ( hi ? uint64_t( ext4_u32( d, 0x24 ) ) << 32 : 0 ), 1 },
+                { ext4_u32( d, 0x08 ) | ( hi ? uint64_t( ext4_u32( d, 0x28 ) ) << 32 : 0 ), itable_blocks },
+            };
+
+            memset( &bitmap[0], 0, bitmap.size() );
+
+            uint64_t used = ext4_has_super( g, ro_compat ) ? std::min( count, 1 + gdt_blocks + rgdt ) : 0;
+
+            for( uint64_t b = 0; b < used; ++b )
+                bitmap[b / 8] |= 1 << b % 8;
+
+            for( unsigned m = 0; m < 3; ++m )
+            {
+                for( uint64_t b = meta[m][0]; b < meta[m][0] + meta[m][1]; ++b )
+                {
+                    if( b >= start && b < start + count )
+                        bitmap[(b - start) / 8] |= 1 << (b - start) % 8;
+                }
+            }
+        }
+        else if( block_bitmap >= blocks ||
+                 pread( fd, &bitmap[0], bs, aSource->offset + block_bitmap * bs ) != (ssize_t) bs )
+        {
+            unused.clear();
+            break;
+        }
+
+        for( uint64_t b = 0; b < count; )
+        {
+            if( bitmap[b / 8] & 1 << b % 8 )
+            {
+                ++b;
+                continue;
+            }
+
+            uint64_t e = b;
+
+            while( e < count && !( bitmap[e / 8] & 1 << e % 8 ) )
+                ++e;
+
+            uint64_t from = ( start + b ) * bs;
+            uint64_t to   = ( start + e ) * bs;
+
+            std::map<uint64_t, uint64_t>::iterator last = unused.end();
+
+            if( !unused.empty() && (--last)->second == from )
+                last->second = to;
+            else
+                unused[from] = to;
+
+            b = e;
+        }
+    }
+
+    close( fd );
+
+    for( std::map<uint64_t, uint64_t>::const_iterator it = unused.begin(); it != unused.end(); ++it )
+        ret += it->second - it->first;
+
+    aSource->unused.swap( unused );
+
+    return ret;
+}
+
+
+/**
+ * Function read_payload
+ * freads up to aLen bytes of the payload of aSource, which fp is positioned
+ * at aPos of, into aBuf.  The unused extents of aSource are skipped over
+ * rather than read and come back as zeros.
+ *
+ * @return size_t - the number of bytes read, short only at end of file.
+ */
+static size_t read_payload( FILE* fp, const SOURCE& aSource, uint64_t aPos, char* aBuf, size_t aLen )
+{
+    size_t done = 0;
+
+    while( done < aLen )
+    {
+        uint64_t pos = aPos + done;
+        uint64_t end = aSource.UnusedEnd( pos );
+
+        if( end > pos )
+        {
+            size_t n = std::min<uint64_t>( end - pos, aLen - done );
+
+            if( fseeko( fp, n, SEEK_CUR ) )
+                break;
+
+            memset( aBuf + done, 0, n );
+            done += n;
+            continue;
+        }
+
+        size_t n = std::min<uint64_t>( aSource.NextUnused( pos ) - pos, aLen - done );
+        size_t got = fread( aBuf + done, 1, n, fp );
+
+        done += got;
+
+        if( got < n )
+            break;
+    }
+
+    return done;
+}
+
+
+/**
+ * Function make_param_block
+ * reads the parameter file fp_in, of which at most aLen bytes belong to it,
+ * into a PART_BLOCK sized buf as the boot loader wants it: PARAM_HEADER,
+ * content, CRC of the content, zero padding.
+ *
+ * @return size_t - the count of bytes before the padding.
+ */
+static size_t make_param_block( FILE* fp_in, char* buf, uint64_t aLen )
+{
+    uint32_t crc = 0;
+    PARAM_HEADER* header = (PARAM_HEADER*) buf;
+
+    memcpy( header->magic, "PARM", sizeof(header->magic) );
+
+    size_t readlen = fread( buf + sizeof(*header), 1,
+                    std::min<uint64_t>( aLen, PART_BLOCK - sizeof(*header) - sizeof(crc) ), fp_in );
+
+    header->length = readlen;
+    crc = rkcrc_update( crc, buf + sizeof(*header), readlen );
+
+    readlen += sizeof(*header);
+
+    memcpy( buf + readlen, &crc, sizeof(crc) );
+    readlen += sizeof(crc);
+    memset( buf + readlen, 0, PART_BLOCK - readlen );
+
+    return readlen;
+}
+
+
+/// Partitions whose gzip compressed input is stored decompressed, -gunzip.
+std::vector<std::string>    GunzipParts;
+
+
+/**
+ * Function gunzip_part
+ * returns true if partition aName was named with -gunzip.
+ */
+static bool gunzip_part( const char* aName )
+{
+    return std::find( GunzipParts.begin(), GunzipParts.end(), aName ) != GunzipParts.end();
+}
+
+
+/**
+ * Function is_gzip
+ * returns true if aBuf, the first aLen bytes of a payload, start with the
+ * magic of a deflate compressed gzip member.
+ */
+static bool is_gzip( const char* aBuf, size_t aLen )
+{
+    return aLen >= 3 && (unsigned char) aBuf[0] == 0x1f &&
+        (unsigned char) aBuf[1] == 0x8b && aBuf[2] == Z_DEFLATED;
+}
+
+
+/**
+ * Struct GUNZIP
+ * decompresses a gzip payload while it is being read, so a compressed input
+ * file needs no temporary copy.  Concatenated gzip members are decompressed
+ * one after another.  Anything but another member after a member fails.
+ */
+struct GUNZIP
+{
+    z_stream            zs;
+    FILE*               fp;
+    uint64_t            left;       // compressed bytes still to read from fp
+    std::vector<char>   in;
+    bool                done;
+    bool                failed;
+    const char*         error;      // why it failed
+
+    /**
+     * Constructor
+     * takes aLen bytes of the payload, already read from aFp, and at most
+     * aLeft more from aFp.
+     */
+    GUNZIP( FILE* aFp, uint64_t aLeft, const char* aBuf, size_t aLen ) :
+        fp( aFp ),
+        left( aLeft ),
+        in( std::max<size_t>( aLen, 1024*1024 ) ),
+        done( false ),
+        failed( false ),
+        error( "is not valid gzip data" )
+    {
+        memset( &zs, 0, sizeof(zs) );
+        memcpy( &in[0], aBuf, aLen );
+
+        zs.next_in  = (Bytef*) &in[0];
+        zs.avail_in = aLen;
+
+        failed = inflateInit2( &zs, 16 + MAX_WBITS ) != Z_OK;       // gzip wrapper only
+    }
+
+    ~GUNZIP()
+    {
+        inflateEnd( &zs );
+    }
+
+    /**
+     * Function Read
+     * fills aBuf with up to aLen decompressed bytes, short only at the end
+     * of the payload.  Check failed afterwards.
+     */
+    size_t Read( char* aBuf, size_t aLen )
+    {
+        zs.next_out  = (Bytef*) aBuf;
+        zs.avail_out = aLen;
+
+        while( zs.avail_out && !done && !failed )
+        {
+            if( !zs.avail_in && left )
+            {
+                zs.next_in  = (Bytef*) &in[0];
+                zs.avail_in = fread( &in[0], 1, std::min<uint64_t>( left, in.size() ), fp );
+                left -= zs.avail_in;
+
+                if( !zs.avail_in )
+                    left = 0;
+            }
+
+            int rc = inflate( &zs, Z_NO_FLUSH );
+
+            if( rc == Z_STREAM_END )
+            {
+                if( !zs.avail_in && left )
+                {
+                    zs.next_in  = (Bytef*) &in[0];
+                    zs.avail_in = fread( &in[0], 1, std::min<uint64_t>( left, in.size() ), fp );
+                    left -= zs.avail_in;
+                }
+
+                if( !zs.avail_in )
+                    done = true;
+                else if( is_gzip( (char*) zs.next_in, zs.avail_in ) )
+                    inflateReset( &zs );
+                else
+                {
+                    error  = "holds data after its last gzip member";
+                    failed = true;
+                }
+            }
+            else if( rc == Z_BUF_ERROR && !zs.avail_in && !left )
+                failed = true;      // truncated
+            else if( rc != Z_OK && rc != Z_BUF_ERROR )
+                failed = true;
+        }
+
+        return aLen - zs.avail_out;
+    }
+};
+
+
+/// Partitions to build a dm-verity hash tree for, -verity.
+std::vector<std::string>    VerityParts;
+
+// dm-verity data and hash block size, as veritysetup defaults to
+#define VERITY_BLOCK    4096
+#define VERITY_DIGEST   32          // SHA-256
+
+
+/**
+ * Struct VERITY_SB
+ * is the superblock veritysetup puts ahead of a hash tree, padded to one
+ * VERITY_BLOCK in the file.
+ */
+struct VERITY_SB
+{
+    char        signature[8];       // "verity\0\0"
+    uint32_t    version;            // 1
+    uint32_t    hash_type;          // 1, salt ahead of the data
+    uint8_t     uuid[16];
+    char        algorithm[32];      // "sha256"
+    uint32_t    data_block_size;
+    uint32_t    hash_block_size;
+    uint64_t    data_blocks;
+    uint16_t    salt_size;
+    uint8_t     pad1[6];
+    uint8_t     salt[256];
+    uint8_t     pad2[168];
+} __attribute__((packed));
+
+
+/**
+ * Struct VERITY
+ * collects the leaf level of the dm-verity hash tree of one partition, the
+ * SHA-256 of each VERITY_BLOCK of its payload, while the payload is copied.
+ * No salt is used.
+ */
+struct VERITY
+{
+    bool                        on;
+    std::vector<unsigned char>  leaves;     // VERITY_DIGEST bytes per data block
+
+    VERITY() : on( false ) {}
+
+    /// makes room for the leaves of aLen bytes, so parallel Hashers never resize
+    void Size( uint64_t aLen )
+    {
+        leaves.assign( ( aLen + VERITY_BLOCK - 1 ) / VERITY_BLOCK * VERITY_DIGEST, 0 );
+    }
+
+    /**
+     * Struct Hasher
+     * turns a run of the payload, fed front to back from a VERITY_BLOCK
+     * boundary, into leaves.  Each thread needs its own.
+     */
+    struct Hasher
+    {
+        VERITY*     v;
+        EVP_MD_CTX* ctx;
+        uint64_t    pos;            // of the next byte, in the payload
+
+        Hasher( VERITY* aVerity ) :
+            v( aVerity && aVerity->on ? aVerity : NULL ),
+            ctx( v ? EVP_MD_CTX_new() : NULL ),
+            pos( 0 )
+        {
+        }
+
+        ~Hasher()
+        {
+            EVP_MD_CTX_free( ctx );
+        }
+
+        /// hashes aLen bytes at aPos of the payload, aBuf NULL meaning zeros
+        void Feed( uint64_t aPos, const char* aBuf, uint64_t aLen );
+
+        /// completes a last, short block with zeros
+        void Pad()
+        {
+            if( v && pos % VERITY_BLOCK )
+                Feed( pos, NULL, VERITY_BLOCK - pos % VERITY_BLOCK );
+        }
+    };
+};
+
+typedef std::vector<VERITY> VERITIES;   // by partition
+
+
+/// the SHA-256 of a VERITY_BLOCK of zeros
+static const unsigned char* verity_zero_digest()
+{
+    struct ZERO_DIGEST
+    {
+        unsigned char digest[VERITY_DIGEST];
+
+        ZERO_DIGEST()
+        {
+            std::vector<char> zeros( VERITY_BLOCK );
+
+            EVP_Digest( &zeros[0], zeros.size(), digest, NULL, EVP_sha256(), NULL );
+        }
+    };
+
+    static ZERO_DIGEST  zero;       // initialized once, even with several threads
+
+    return zero.digest;
+}
+
+
+void VERITY::Hasher::Feed( uint64_t aPos, const char* aBuf, uint64_t aLen )
+{
+    if( !v )
+        return;
+
+    static const char zeros[VERITY_BLOCK] = {};
+
+    pos = aPos;
+
+    while( aLen )
+    {
+        uint64_t        block = pos / VERITY_BLOCK;
+        unsigned        off   = pos % VERITY_BLOCK;
+        uint64_t        n     = std::min<uint64_t>( aLen, VERITY_BLOCK - off );
+
+        if( ( block + 1 ) * VERITY_DIGEST > v->leaves.size() )
+            v->leaves.resize( ( block + 1 ) * VERITY_DIGEST );
+
+        if( !off && n == VERITY_BLOCK && ( !aBuf || all_zero( aBuf, n ) ) )
+        {
+            // whole zero blocks all have the same digest
+            uint64_t count = aBuf ? 1 : aLen / VERITY_BLOCK;
+
+            if( ( block + count ) * VERITY_DIGEST > v->leaves.size() )
+                v->leaves.resize( ( block + count ) * VERITY_DIGEST );
+
+            for( uint64_t b = 0; b < count; ++b )
+                memcpy( &v->leaves[( block + b ) * VERITY_DIGEST], verity_zero_digest(), VERITY_DIGEST );
+
+            n = count * VERITY_BLOCK;
+        }
+        else
+        {
+            if( !off )
+                EVP_DigestInit_ex( ctx, EVP_sha256(), NULL );
+
+            EVP_DigestUpdate( ctx, aBuf ? aBuf : zeros, n );
+
+            if( off + n == VERITY_BLOCK )
+                EVP_DigestFinal_ex( ctx, &v->leaves[block * VERITY_DIGEST], NULL );
+        }
+
+        pos  += n;
+        aLen -= n;
+
+        if( aBuf )
+            aBuf += n;
+    }
+}
+
+
+/**
+ * Function write_verity
+ * hashes the leaves of aVerity up to the root and writes the tree the way
+ * "veritysetup format" lays it out to aPath: a VERITY_SB block, then the
+ * levels from the root down.  The root hash, in hex, goes to aPath.roothash
+ * and to stdout.
+ */
+static int write_verity( const VERITY& aVerity, const char* aName, const std::string& aPath )
+{
+    std::vector< std::vector<unsigned char> >   levels;
+    std::vector<unsigned char>                  digests = aVerity.leaves;
+    uint64_t                                    data_blocks = digests.size() / VERITY_DIGEST;
+
+    if( digests.empty() )
+    {
+        fprintf( stderr, "%s: partition '%s' is empty, there is nothing to build a hash tree of\n",
+            __func__, aName );
+        return -1;
+    }
+
+    while( digests.size() > VERITY_DIGEST )
+    {
+        std::vector<unsigned char>  level( digests );
+
+        level.resize( ( digests.size() + VERITY_BLOCK - 1 ) / VERITY_BLOCK * VERITY_BLOCK );    // zero padded
+
+        std::vector<unsigned char>  next( level.size() / VERITY_BLOCK * VERITY_DIGEST );
+
+        for( uint64_t b = 0; b < level.size() / VERITY_BLOCK; ++b )
+        {
+            EVP_Digest( &level[b * VERITY_BLOCK], VERITY_BLOCK, &next[b * VERITY_DIGEST],
+                        NULL, EVP_sha256(), NULL );
+        }
+
+        levels.push_back( level );
+        digests.swap( next );
+    }
+
+    VERITY_SB   sb;
+    char        root[2 * VERITY_DIGEST + 1] = "";
+
+    for( unsigned i = 0; i < digests.size(); ++i )
+        sprintf( root + 2 * i, "%02x", digests[i] );
+
+    memset( &sb, 0, sizeof(sb) );
+    memcpy( sb.signature, "verity\0\0", sizeof(sb.signature) );
+    sb.version          = 1;
+    sb.hash_type        = 1;
+    strcpy( sb.algorithm, "sha256" );
+    sb.data_block_size  = VERITY_BLOCK;
+    sb.hash_block_size  = VERITY_BLOCK;
+    sb.data_blocks      = data_blocks;
+
+    // a stable UUID, taken from the root hash, so a repack gives the same file
+    memcpy( sb.uuid, &digests[0], std::min<size_t>( sizeof(sb.uuid), digests.size() ) );
+    sb.uuid[6] = ( sb.uuid[6] & 0x0f ) | 0x40;
+    sb.uuid[8] = ( sb.uuid[8] & 0x3f ) | 0x80;
+
+    std::vector<char>   first( VERITY_BLOCK );
+
+    memcpy( &first[0], &sb, sizeof(sb) );
+
+    FILE*   fp = fopen( aPath.c_str(), "wb" );
+    bool    ok = fp && fwrite( &first[0], 1, first.size(), fp ) == first.size();
+
+    for( size_t l = levels.size(); ok && l--; )
+        ok = fwrite( &levels[l][0], 1, levels[l].size(), fp ) == levels[l].size();
+
+    if( fp && fclose( fp ) )
+        ok = false;
+
+    fp = ok ? fopen( ( aPath + ".roothash" ).c_str(), "w" ) : NULL;
+    ok = fp && fprintf( fp, "%s\n", root ) > 0;
+
+    if( fp && fclose( fp ) )
+        ok = false;
+
+    if( !ok )
+    {
+        fprintf( stderr, "%s: can't write '%s': %s\n", __func__, aPath.c_str(), strerror( errno ) );
+        return -1;
+    }
+
+    printf( "Verity root hash: %-24s  %s  (tree in %s)\n", aName, root, aPath.c_str() );
+
+    return 0;
+}
+
+
+/**
+ * Function import_package
+ * copies an external file, or tar member, into this update image, padded to a multiple of
+ * Align bytes, and continues *aCrc over every byte written.  The CRC of the
+ * partition alone, without padding, goes to pack->crc.  The gzip compressed
+ * input of a -gunzip partition is stored decompressed.  The payload is also hashed into aVerity, if
+ * that is on.
+ */
+int import_package( FILE* fp_update, UPDATE_PART64* pack, const SOURCE& aSource, uint32_t* aCrc,
+                    VERITY* aVerity )
+{
+    int         ret = 0;
+    char        buf[PART_BLOCK];
+    size_t      readlen;
+    uint64_t    left = aSource.member.empty() ? ~uint64_t(0) : aSource.len;
+
+    pack->part_offset = ftello( fp_update );
+
+    FILE*   fp_in = aSource.Open();
+
+    if( !fp_in )
+    {
+        fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, aSource.Name().c_str() );
+        return -1;
+    }
+
+    if( strcmp( pack->name, "parameter" ) == 0 )
+    {
+        readlen = make_param_block( fp_in, buf, left );
+
+        fwrite( buf, 1, sizeof(buf), fp_update );
+
+        pack->crc = rkcrc_update( 0, buf, readlen );
+        *aCrc = rkcrc_combine( *aCrc, pack->crc, readlen );
+        *aCrc = rkcrc_zeros( *aCrc, sizeof(buf) - readlen );
+
+        pack->part_bytecount  += readlen;
+        pack->padded_size += sizeof(buf);
+    }
+    else
+    {
+        // a multiple of PART_BLOCK, so only the final read needs padding
+        std::vector<char>   buffer( 512 * sizeof(buf) );
+        GUNZIP*             gunzip = NULL;
+        VERITY::Hasher      hasher( aVerity );
+
+        pack->crc = 0;
+
+        readlen = read_payload( fp_in, aSource, 0, &buffer[0], std::min<uint64_t>( left, buffer.size() ) );
+        left -= readlen;
+
+        if( gunzip_part( pack->name ) && !is_gzip( &buffer[0], readlen ) )
+        {
+            fprintf( stderr, "%s: -gunzip input file '%s' is not gzip compressed\n",
+                __func__, aSource.Name().c_str() );
+            fclose( fp_in );
+            return -1;
+        }
+
+        if( gunzip_part( pack->name ) )
+        {
+            printf( "Decompressing: %s\n", aSource.Name().c_str() );
+
+            gunzip  = new GUNZIP( fp_in, left, &buffer[0], readlen );
+            readlen = gunzip->Read( &buffer[0], buffer.size() );
+        }
+
+        while( readlen )
+        {
+            size_t  padded = (readlen + sizeof(buf) - 1) / sizeof(buf) * sizeof(buf);
+
+            memset( &buffer[readlen], 0, padded - readlen );
+
+            fwrite( &buffer[0], 1, padded, fp_update );
+
+            pack->crc = crc_skip_zeros( pack->crc, &buffer[0], readlen );
+            hasher.Feed( pack->part_bytecount, &buffer[0], readlen );
+
+            pack->part_bytecount += readlen;
+            pack->padded_size    += padded;
+
+            if( gunzip )
+                readlen = gunzip->Read( &buffer[0], buffer.size() );
+            else
+            {
+                readlen = read_payload( fp_in, aSource, pack->part_bytecount, &buffer[0],
+                                        std::min<uint64_t>( left, buffer.size() ) );
+                left -= readlen;
+            }
+        }
+
+        if( gunzip && gunzip->failed )
+        {
+            fprintf( stderr, "%s: input file '%s' %s\n", __func__, aSource.Name().c_str(), gunzip->error );
+            ret = -1;
+        }
+
+        delete gunzip;
+        hasher.Pad();
+
+        *aCrc = rkcrc_combine( *aCrc, pack->crc, pack->part_bytecount );
+        *aCrc = rkcrc_zeros( *aCrc, pack->padded_size - pack->part_bytecount );
+    }
+
+    fclose( fp_in );
+
+    // so the next partition starts on the Align boundary
+    put_zeros( fp_update, align_up( pack->padded_size ) - pack->padded_size, aCrc );
+    pack->padded_size = align_up( pack->padded_size );
+
+    return ret;
+}
+
+
+/**
+ * Function append_crc
+ * writes the trailing CRC of the whole image without reading it back.  The
+ * header was only a place holder while the payload streamed out, so its CRC
+ * is computed now and combined with aPayloadCrc, the CRC of everything after it.
+ */
+void append_crc( FILE* fp, const std::vector<char>& aHeader, uint32_t aPayloadCrc )
+{
+    fseeko( fp, 0, SEEK_END );
+
+    off_t file_len = ftello( fp );
+
+    if( file_len == (off_t) -1 )
+        return;
+
+    printf( "Adding CRC...\n" );
+
+    uint32_t crc = rkcrc_update( 0, &aHeader[0], aHeader.size() );
+
+    crc = rkcrc_combine( crc, aPayloadCrc, file_len - aHeader.size() );
+
+    fwrite( &crc, 1, sizeof(crc), fp );
+}
+
+
+typedef std::map< std::string, unsigned >   PAD_MAP;
+
+static unsigned find_in_map( const std::string& aName, const PAD_MAP& aMap )
+{
+    PAD_MAP::const_iterator it = aMap.find( aName );
+
+    if( it == aMap.end() )
+        return 0;
+
+    return it->second;
+}
+
+
+// convert bytes to 512 byte sectors
+#define BYTES2SECTORS(x)        unsigned((uint64_t(x)+511)/512)
+#define MBYTES(x)               ( uint64_t(x)*1024*1024)
+#define GBYTES(x)               ( uint64_t(x)*1024*1024*1024)
+
+
+unsigned partition_constraints( unsigned aSize, const std::string& aPartitionName )
+{
+    // tables of bootloader partion names and sizes
+
+    // minimums:
+    // partition may not be smaller than this.
+    static const PAD_MAP minimums = {
+        { "bootloader",     BYTES2SECTORS( MBYTES(1) ) },            // 1*1024*1024 = a megabyte
+        { "boot",           BYTES2SECTORS( MBYTES(16) ) },
+
+        // This is a hack for my 32 gbyte emmc, gives me a 6 gbyte swap
+        // partition without having to supply an image file.
+        { "swap",           BYTES2SECTORS( GBYTES(6)) },
+    };
+
+    // paddings:
+    // to add to the end of respective parition's input file size.
+    static const PAD_MAP paddings = {
+        { "bootloader",     BYTES2SECTORS( MBYTES(1) ) },
+        { "recover-script", BYTES2SECTORS( MBYTES(1) ) },
+        { "linuxroot",      BYTES2SECTORS( MBYTES(5) ) },
+    };
+
+    aSize += find_in_map( aPartitionName, paddings );
+
+    unsigned minimum = find_in_map( aPartitionName, minimums );
+
+    if( aSize < minimum )
+        aSize = minimum;
+
+    return aSize;           // return value is in 512 byte sized "sectors".
+}
+
+
+int compute_cmdline( const char* srcdir )
+{
+    char    buf[4096];
+
+    snprintf( buf, sizeof(buf), "%s/%s", srcdir, "package-file" );
+
+    if( Packages.GetPackages( buf ) )
+        return -1;
+
+    struct stat st;
+
+    fprintf( stderr, "fragment for CMDLINE:\n" );
+
+    printf( "mtdparts=rk29xxnand:" );
+
+    // The contents of the package-list file drive this loop.
+    // All offsets and sizes are in units of 512 bytes, i.e. a sector.
+
+    unsigned flash_offset = 0x2000;     // start of flash allocation in sectors
+    for( unsigned i=0; i < Packages.size();  ++i )
+    {
+        int failed = stat( Packages[i].fullpath.c_str(), &st );
+
+        if( failed )
+            st.st_size = 0;
+
+        unsigned file_sectors = BYTES2SECTORS( st.st_size );
+
+        file_sectors = partition_constraints( file_sectors, Packages[i].name );
+
+        if( failed &&
+            Packages[i].fullpath != "RESERVED" &&
+            Packages[i].name != "swap" )
+        {
+            fprintf( stderr,
+                "%s: unable to open '%s' partition's file '%s'\n",
+                __func__,
+                Packages[i].name.c_str(),
+                Packages[i].fullpath.c_str()
+                );
+            return -2;
+        }
+
+        unsigned cur_flash_sectors = file_sectors;      // partition size in sectors
+        unsigned cur_flash_offset  = flash_offset;      // partition offset in sectors
+
+        flash_offset += cur_flash_sectors;
+
+        if( i )
+            printf( "," );
+
+        D( fprintf( stderr,
+            "name:%-12s cur_flash_sectors:0x%x cur_flash_offset:0x%0x\n",
+            Packages[i].name.c_str(),
+            cur_flash_sectors, cur_flash_offset
+            ); )
+
+        if( i == Packages.size()-1 )
+        {
+            // The last linux partition is set to expand on first boot using the
+            // '-' size field, so make sure of this partition name in your
+            // "package-file".  For linux it's sensibly "linuxroot".
+            printf( "-@0x%x(%s)",
+                cur_flash_offset,
+                Packages[i].name.c_str()
+                );
+        }
+        else
+        {
+            printf( "0x%x@0x%x(%s)",
+                cur_flash_sectors,
+                cur_flash_offset,
+                Packages[i].name.c_str()
+                );
+        }
+    }
+
+    printf( "\n" );
+
+    return 0;
+}
+
+
+/**
+ * Function set_part_crcs
+ * gives each partition which shares its payload with one copied from
+ * aSources that one's CRC, and marks the CRCs of image as known.
+ */
+static void set_part_crcs( IMAGE& image, const SOURCES& aSources )
+{
+    for( unsigned i = 0; i < image.parts.size(); ++i )
+    {
+        UPDATE_PART64& part = image.parts[i];
+
+        if( !aSources[i].empty() )
+            continue;
+
+        part.crc = 0;
+
+        for( unsigned j = 0; j < image.parts.size(); ++j )
+        {
+            if( !aSources[j].empty() && part.part_bytecount &&
+                image.parts[j].part_offset == part.part_offset &&
+                image.parts[j].part_bytecount == part.part_bytecount )
+            {
+                part.crc = image.parts[j].crc;
+                break;
+            }
+        }
+    }
+
+    image.has_crcs = true;
+}
+
+
+/**
+ * Function finish_header
+ * fills in the header fields which depend on the length of the whole image,
+ * aImageLen, not counting its trailing CRC.
+ */
+static void finish_header( IMAGE& image, uint64_t aImageLen )
+{
+    image.head.length = aImageLen;
+
+    for( unsigned i = 0; i < image.parts.size(); ++i )
+    {
+        UPDATE_PART64& part = image.parts[i];
+
+        if( strcmp( part.fullpath, "SELF" ) == 0 )
+        {
+            part.part_bytecount = aImageLen + 4;
+
+            // in bytes, as the original tool did
+            part.flash_size = std::min<uint64_t>( round_up( part.part_bytecount ), uint32_t(~0) );
+            break;
+        }
+    }
+}
+
+
+/**
+ * Function pack_stream
+ * writes the image sequentially, letting import_package() find out the size
+ * of each partition as it copies it, then comes back to rewrite the header.
+ * This works for any kind of input file.
+ */
+static int pack_stream( const char* dstfile, IMAGE& image, const SOURCES& aSources, VERITIES& aVerity )
+{
+    int         ret = 0;
+    std::string error;
+
+    FILE* fp_update = fopen( dstfile, "wb+" );
+
+    if( !fp_update )
+    {
+        fprintf( stderr, "Can't open file \"%s\": %s\n", dstfile, strerror( errno ) );
+        return -1;
+    }
+
+    // put out an inaccurate place holder, planning to come back later and update it.
+    std::vector<char>   placeholder( image.HeaderSize() );
+
+    fwrite( &placeholder[0], placeholder.size(), 1, fp_update );
+
+    uint32_t payload_crc = 0;       // of everything after the header
+
+    // the partitions pad themselves to Align, only the header needs it here
+    put_zeros( fp_update, align_up( placeholder.size() ) - placeholder.size(), &payload_crc );
+
+    for( unsigned i = 0; i < image.parts.size() && !ret; ++i )
+    {
+        if( !aSources[i].empty() )
+            ret = import_package( fp_update, &image.parts[i], aSources[i], &payload_crc, &aVerity[i] );
+    }
+
+    finish_header( image, ftello( fp_update ) );
+    set_part_crcs( image, aSources );
+
+    if( !ret && !image.Fits( &error ) )
+    {
+        fprintf( stderr, "%s: %s\n", __func__, error.c_str() );
+        ret = -2;
+    }
+
+    std::vector<char>   header = image.Bytes();
+
+    fseeko( fp_update, 0, SEEK_SET );
+    fwrite( &header[0], header.size(), 1, fp_update );
+
+    append_crc( fp_update, header, payload_crc );
+
+    fclose( fp_update );
+
+    return ret;
+}
+
+
+/**
+ * Function same_content
+ * returns true if the payloads aA and aB, both aLen bytes long, hold the
+ * same bytes.  A file which can't be read is not the same as anything.
+ */
+static bool same_content( const SOURCE& aA, const SOURCE& aB, uint64_t aLen )
+{
+    int     fa = open( aA.path.c_str(), O_RDONLY );
+    int     fb = open( aB.path.c_str(), O_RDONLY );
+    bool    same = fa != -1 && fb != -1;
+
+    std::vector<char>   a( 1024*1024 );
+    std::vector<char>   b( a.size() );
+
+    for( uint64_t pos = 0; same && pos < aLen; pos += a.size() )
+    {
+        size_t ask = std::min<uint64_t>( aLen - pos, a.size() );
+
+        same = pread( fa, &a[0], ask, aA.offset + pos ) == (ssize_t) ask &&
+               pread( fb, &b[0], ask, aB.offset + pos ) == (ssize_t) ask &&
+               !memcmp( &a[0], &b[0], ask );
+    }
+
+    if( fa != -1 )
+        close( fa );
+
+    if( fb != -1 )
+        close( fb );
+
+    return same;
+}
+
+
+/**
+ * Function layout_packages
+ * works out the part_offset, part_bytecount and padded_size of every partition
+ * from the sizes of the input files, exactly as import_package() would find
+ * them.  That is only possible when every input is an uncompressed regular
+ * file.  Every payload starts on an Align boundary.
+ *
+ * A partition whose input is the same file as an earlier one's, or has the
+ * same content if DedupContent, is not stored again.  Its record points at
+ * the earlier payload and its entry in aSources is cleared, since there is
+ * nothing left to copy for it.
+ *
+ * @return uint64_t - the length of the image without its CRC, or 0 when the
+ *  layout cannot be known ahead of copying.
+ */
+static uint64_t layout_packages( IMAGE& image, SOURCES& aSources )
+{
+    IMAGE                       layout = image;     // image and aSources are left alone on failure
+    uint64_t                    offset = align_up( image.HeaderSize() );
+    std::vector<bool>           dup( layout.parts.size(), false );
+    std::vector<struct stat>    sts( layout.parts.size() );
+    std::vector<uint64_t>       sizes( layout.parts.size() );
+
+    for( unsigned i = 0; i < layout.parts.size(); ++i )
+    {
+        UPDATE_PART64&  part = layout.parts[i];
+        struct stat&    st = sts[i];
+
+        if( aSources[i].empty() )
+            continue;
+
+        if( stat( aSources[i].path.c_str(), &st ) || !S_ISREG( st.st_mode ) )
+            return 0;
+
+        // a compressed input's size is only known once it is decompressed
+        if( gunzip_part( part.name ) )
+            return 0;
+
+        uint64_t size = sizes[i] = aSources[i].Size( st );
+
+        // the parameter partition is rewritten into a PARM block, not copied
+        for( unsigned j = 0; j < i && strcmp( part.name, "parameter" ); ++j )
+        {
+            UPDATE_PART64& prev = layout.parts[j];
+
+            if( aSources[j].empty() || dup[j] || strcmp( prev.name, "parameter" ) == 0 ||
+                sizes[j] != size )
+            {
+                continue;
+            }
+
+            if( ( sts[j].st_dev == st.st_dev && sts[j].st_ino == st.st_ino &&
+                  aSources[j].offset == aSources[i].offset ) ||
+                ( DedupContent && same_content( aSources[j], aSources[i], size ) ) )
+            {
+                printf( "Sharing payload: %-24s  with: %s\n", part.name, prev.name );
+
+                part.part_offset    = prev.part_offset;
+                part.part_bytecount = prev.part_bytecount;
+                part.padded_size    = prev.padded_size;
+                dup[i] = true;
+                break;
+            }
+        }
+
+        if( dup[i] )
+            continue;
+
+        part.part_offset = offset;
+
+        if( strcmp( part.name, "parameter" ) == 0 )
+        {
+            uint64_t room = PART_BLOCK - sizeof(PARAM_HEADER) - sizeof(uint32_t);
+
+            part.part_bytecount = std::min<uint64_t>( size, room ) + PART_BLOCK - room;
+            part.padded_size    = align_up( PART_BLOCK );
+        }
+        else
+        {
+            part.part_bytecount = size;
+            part.padded_size    = align_up( (size + PART_BLOCK - 1) / PART_BLOCK * PART_BLOCK );
+        }
+
+        offset += part.padded_size;
+    }
+
+    image = layout;
+
+    for( unsigned i = 0; i < layout.parts.size(); ++i )
+    {
+        if( dup[i] )
+            aSources[i].clear();
+    }
+
+    return offset;
+}
+
+
+/**
+ * Function payload_data
+ * is seek_data() within the payload of aSource, which also steps over the
+ * unused extents of aSource.  aPos, aEnd and the result are file offsets.
+ */
+static uint64_t payload_data( int aFd, const SOURCE& aSource, uint64_t aPos, uint64_t aEnd )
+{
+    for(;;)
+    {
+        aPos = seek_data( aFd, aPos, aEnd );
+
+        uint64_t end = aSource.UnusedEnd( aPos - aSource.offset ) + aSource.offset;
+
+        if( end == aPos || aPos >= aEnd )
+            return aPos;
+
+        aPos = std::min( end, aEnd );
+    }
+}
+
+
+/**
+ * Function payload_hole
+ * is seek_hole() within the payload of aSource, which also stops at the
+ * next unused extent of aSource.  aPos, aEnd and the result are file offsets.
+ */
+static uint64_t payload_hole( int aFd, const SOURCE& aSource, uint64_t aPos, uint64_t aEnd )
+{
+    uint64_t next = aSource.NextUnused( aPos - aSource.offset );
+
+    if( next != ~uint64_t(0) )
+        aEnd = std::min( aEnd, next + aSource.offset );
+
+    return seek_hole( aFd, aPos, aEnd );
+}
+
+
+/**
+ * Struct PACK_JOB
+ * is one image to pack: where it goes, its header and layout as worked out
+ * from its src_dir by prepare_pack(), where each payload comes from, and the
+ * dm-verity trees to build on the way.
+ */
+struct PACK_JOB
+{
+    std::string     dstfile;
+    IMAGE           image;
+    SOURCES         sources;
+    VERITIES        verity;
+    uint64_t        len;        // from layout_packages(), 0 if only pack_stream() can write it
+
+    // each -verity partition by name, with the partition which copies its payload
+    std::vector< std::pair<std::string, unsigned> > trees;
+
+    PACK_JOB() :
+        image( Extended ),
+        len( 0 )
+    {
+    }
+};
 
-        for( unsigned i=0;  i < size();  ++i )
-            (*this)[i].Show( fp );
+
+/**
+ * Function pack_parallel
+ * writes images whose layout_packages() is known.  The outputs are
+ * preallocated, the headers are final from the start, and run_jobs() workers
+ * copy CRC_CHUNK sized pieces of the partitions straight into their slots
+ * with copy_range(), so on a copy-on-write file system block aligned parts
+ * are cloned from the inputs rather than written.  The pieces are still read
+ * for their CRC, except for holes and unused extents in the inputs, which
+ * stay holes in the images like any zero blocks.  The padding is never
+ * written, it is already zero.  The trailing CRCs are assembled from the
+ * header CRC, the piece CRCs and the padding with image_crc().  The workers
+ * also hash the leaves of the dm-verity trees.
+ *
+ * An input which several of aJobs use, the same file at the same offset, is
+ * read and hashed once and copied to each of them.
+ */
+static int pack_parallel( const std::vector<PACK_JOB*>& aJobs )
+{
+    // a distinct payload, and every partition of every job it goes to
+    struct INPUT
+    {
+        const SOURCE*   src;
+        int             fd;
+        dev_t           dev;
+        ino_t           ino;
+        uint64_t        len;
+        uint32_t        crc;
+        VERITY          verity;     // on if any target wants a tree
+
+        std::vector< std::pair<unsigned, unsigned> >    targets;    // job, part
+    };
+
+    struct PIECE
+    {
+        unsigned        input;
+        uint64_t        offset;         // within the input file
+        uint64_t        len;
+        uint32_t        crc;
+        std::string     error;
+    };
+
+    int                 ret = 0;
+    std::string         error;
+    std::vector<int>    outs( aJobs.size(), -1 );
+    std::vector<INPUT>  inputs;
+
+    // each part of each job learns its own copy method
+    std::deque< std::deque<COPY_SINK> > sinks;
+
+    for( unsigned j = 0; j < aJobs.size() && !ret; ++j )
+    {
+        PACK_JOB&       job = *aJobs[j];
+        IMAGE&          image = job.image;
+        const char*     dstfile = job.dstfile.c_str();
+
+        sinks.emplace_back( image.parts.size() );
+
+        finish_header( image, job.len );
+
+        if( !image.Fits( &error ) )
+        {
+            fprintf( stderr, "%s: %s\n", __func__, error.c_str() );
+            ret = -2;
+            break;
+        }
+
+        int fd = outs[j] = open( dstfile, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+
+        if( fd == -1 )
+        {
+            fprintf( stderr, "Can't open file \"%s\": %s\n", dstfile, strerror( errno ) );
+            ret = -1;
+            break;
+        }
+
+        // extents cloned from the inputs would only replace preallocated ones,
+        // so when everything is on one file system leave the output sparse.  Also
+        // when an input is sparse, its holes are to stay holes.
+        struct stat             st;
+        bool                    same_fs = fstat( fd, &st ) == 0;
+        bool                    sparse  = false;
+        dev_t                   dev = st.st_dev;
+
+        for( unsigned i = 0; i < image.parts.size(); ++i )
+        {
+            if( job.sources[i].empty() || stat( job.sources[i].path.c_str(), &st ) )
+                continue;
+
+            same_fs = same_fs && st.st_dev == dev;
+            sparse  = sparse || uint64_t( st.st_blocks ) * 512 < uint64_t( st.st_size ) ||
+                      !job.sources[i].unused.empty();
+        }
+
+        if( ( same_fs || sparse || posix_fallocate( fd, 0, job.len + 4 ) ) && ftruncate( fd, job.len + 4 ) )
+        {
+            fprintf( stderr, "Can't size file \"%s\": %s\n", dstfile, strerror( errno ) );
+            ret = -1;
+            break;
+        }
+
+        for( unsigned i = 0; i < image.parts.size() && !ret; ++i )
+        {
+            UPDATE_PART64&  part = image.parts[i];
+            const SOURCE&   src = job.sources[i];
+
+            if( src.empty() )
+                continue;
+
+            if( stat( src.path.c_str(), &st ) )
+            {
+                fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, src.Name().c_str() );
+                ret = -1;
+            }
+            else if( strcmp( part.name, "parameter" ) == 0 )
+            {
+                FILE*   fp_in = src.Open();
+                char    param[PART_BLOCK];
+
+                if( !fp_in )
+                {
+                    fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, src.Name().c_str() );
+                    ret = -1;
+                    break;
+                }
+
+                make_param_block( fp_in, param, src.member.empty() ? ~uint64_t(0) : src.len );
+                fclose( fp_in );
+
+                part.crc = rkcrc_update( 0, param, part.part_bytecount );
+
+                if( pwrite( fd, param, sizeof(param), part.part_offset ) != sizeof(param) )
+                    ret = -1;
+            }
+            else
+            {
+                sinks[j][i].name = dstfile;
+                sinks[j][i].SetFd( fd );
+
+                unsigned k = 0;
+
+                while( k < inputs.size() &&
+                       !( inputs[k].dev == st.st_dev && inputs[k].ino == st.st_ino &&
+                          inputs[k].src->offset == src.offset && inputs[k].len == part.part_bytecount ) )
+                {
+                    ++k;
+                }
+
+                if( k == inputs.size() )
+                {
+                    INPUT in;
+
+                    in.src = &src;
+                    in.fd  = open( src.path.c_str(), O_RDONLY );
+                    in.dev = st.st_dev;
+                    in.ino = st.st_ino;
+                    in.len = part.part_bytecount;
+                    in.crc = 0;
+
+                    inputs.push_back( in );
+
+                    if( in.fd == -1 )
+                    {
+                        fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, src.Name().c_str() );
+                        ret = -1;
+                    }
+                }
+
+                inputs[k].targets.push_back( std::make_pair( j, i ) );
+                inputs[k].verity.on = inputs[k].verity.on || job.verity[i].on;
+            }
+        }
     }
 
-    PARTITION* FindByName( const std::string& aName )
+    std::vector<PIECE> pieces;
+
+    for( unsigned k = 0; k < inputs.size() && !ret; ++k )
     {
-        for( unsigned i=0;  i < size();  ++i )
+        INPUT& in = inputs[k];
+
+        if( in.verity.on )
+            in.verity.Size( in.len );
+
+        for( uint64_t pos = 0; pos < in.len; pos += CRC_CHUNK )
         {
-            PARTITION* part = &(*this)[i];
+            PIECE piece;
 
-            if( part->name == aName )
-                return part;
+            piece.input  = k;
+            piece.offset = in.src->offset + pos;
+            piece.len    = std::min<uint64_t>( CRC_CHUNK, in.len - pos );
+            piece.crc    = 0;
+
+            pieces.push_back( piece );
         }
+    }
 
-        if( aName ==  FirstPartition.name )
+    if( aJobs.size() > 1 && !ret )
+        printf( "Reading %zu distinct inputs for %zu images\n", inputs.size(), aJobs.size() );
+
+    size_t bad = ret ? 0 : run_jobs( pieces.size(), [&]( size_t i )
+    {
+        std::vector<char>   buffer( 1024*1024 );
+        PIECE&              piece = pieces[i];
+        INPUT&              in    = inputs[piece.input];
+        uint64_t            rel   = piece.offset - in.src->offset;      // within the payload
+        uint64_t            data_end = 0;
+        VERITY::Hasher      hasher( &in.verity );
+
+        for( uint64_t done = 0; done < piece.len; )
         {
-            return &FirstPartition;
+            if( done == data_end )
+            {
+                uint64_t data = payload_data( in.fd, *in.src, piece.offset + done, piece.offset + piece.len );
+
+                piece.crc = rkcrc_zeros( piece.crc, data - ( piece.offset + done ) );
+                hasher.Feed( rel + done, NULL, data - ( piece.offset + done ) );
+                done      = data - piece.offset;
+                data_end  = payload_hole( in.fd, *in.src, data, piece.offset + piece.len ) - piece.offset;
+                continue;
+            }
+
+            size_t  ask = std::min<uint64_t>( data_end - done, buffer.size() );
+            ssize_t got = pread( in.fd, &buffer[0], ask, piece.offset + done );
+
+            if( got != (ssize_t) ask )
+            {
+                piece.error = "input file '" + in.src->Name() + "' shrank while packing";
+                return false;
+            }
+
+            for( unsigned t = 0; t < in.targets.size(); ++t )
+            {
+                unsigned    j   = in.targets[t].first;
+                unsigned    p   = in.targets[t].second;
+                uint64_t    dst = aJobs[j]->image.parts[p].part_offset + rel;
+
+                if( copy_range( sinks[j][p], in.fd, piece.offset + done,
+                                &buffer[0], got, dst + done, &piece.error ) )
+                    return false;
+            }
+
+            piece.crc = crc_skip_zeros( piece.crc, &buffer[0], got );
+            hasher.Feed( rel + done, &buffer[0], got );
+            done += got;
         }
 
-        return NULL;
+        hasher.Pad();
+
+        return true;
+    } );
+
+    if( !ret && bad < pieces.size() )
+    {
+        fprintf( stderr, "%s: %s\n", __func__, pieces[bad].error.c_str() );
+        ret = -1;
     }
 
-    int Parse( char* str );
-};
+    for( unsigned k = 0; k < inputs.size(); ++k )
+    {
+        if( inputs[k].fd != -1 )
+            close( inputs[k].fd );
+    }
+
+    if( !ret )
+    {
+        for( size_t p = 0; p < pieces.size(); ++p )
+        {
+            INPUT& in = inputs[pieces[p].input];
 
+            in.crc = rkcrc_combine( in.crc, pieces[p].crc, pieces[p].len );
+        }
 
-PARAMETERS  Parameters;
+        for( unsigned k = 0; k < inputs.size(); ++k )
+        {
+            for( unsigned t = 0; t < inputs[k].targets.size(); ++t )
+            {
+                PACK_JOB&   job = *aJobs[inputs[k].targets[t].first];
+                unsigned    p   = inputs[k].targets[t].second;
 
-PACKAGES    Packages;
+                job.image.parts[p].crc = inputs[k].crc;
 
-PARTITIONS  Partitions;
+                if( job.verity[p].on )
+                    job.verity[p].leaves = inputs[k].verity.leaves;
+            }
+        }
+    }
+
+    for( unsigned j = 0; j < aJobs.size() && !ret; ++j )
+    {
+        PACK_JOB&   job = *aJobs[j];
 
+        printf( "Adding CRC...\n" );
 
-int PARTITIONS::Parse( char* str )
+        set_part_crcs( job.image, job.sources );
+
+        std::vector<char>   header = job.image.Bytes();
+        uint32_t            crc = image_crc( job.image, rkcrc_update( 0, &header[0], header.size() ), job.len );
+
+        if( pwrite( outs[j], &header[0], header.size(), 0 ) != (ssize_t) header.size() ||
+            pwrite( outs[j], &crc, sizeof(crc), job.len ) != sizeof(crc) )
+        {
+            fprintf( stderr, "%s: error writing output: %s\n", __func__, strerror( errno ) );
+            ret = -1;
+        }
+    }
+
+    for( unsigned j = 0; j < outs.size(); ++j )
+    {
+        if( outs[j] != -1 && close( outs[j] ) && !ret )
+        {
+            fprintf( stderr, "%s: error writing output: %s\n", __func__, strerror( errno ) );
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+/**
+ * Function pack_pipe
+ * writes an image whose layout_packages() is known to fp strictly front to
+ * back, so fp may be a pipe.  The header goes first, already final except for
+ * the partition CRCs, which would need another read of the inputs and are
+ * left out.  The trailing CRC is computed on the way.
+ */
+static int pack_pipe( FILE* fp, IMAGE& image, const SOURCES& aSources, VERITIES& aVerity,
+        uint64_t aImageLen )
 {
-    clear();
+    std::string error;
 
-    char*   parts = strchr( str, ':' );
+    finish_header( image, aImageLen );
 
-    if( parts )
+    if( !image.Fits( &error ) )
     {
-        char*   token1 = NULL;
+        fprintf( stderr, "%s: %s\n", __func__, error.c_str() );
+        return -2;
+    }
 
-        ++parts;
+    std::vector<char>   header = image.Bytes();
+    uint32_t            crc = rkcrc_update( 0, &header[0], header.size() );
+    uint64_t            pos = header.size();        // written so far
+    std::vector<char>   buffer( 1024*1024 );
 
-        char* tok = strtok_r( parts, ",", &token1 );
+    fwrite( &header[0], 1, header.size(), fp );
 
-        for( ; tok; tok = strtok_r( NULL, ",", &token1 ) )
+    for( unsigned i = 0; i < image.parts.size(); ++i )
+    {
+        UPDATE_PART64& part = image.parts[i];
+
+        if( aSources[i].empty() )
+            continue;
+
+        put_zeros( fp, part.part_offset - pos, &crc );
+
+        FILE*       fp_in = aSources[i].Open();
+        uint64_t    len = 0;
+
+        if( !fp_in )
         {
-            char*    ptr;
-            unsigned sector_count = strtoul( tok, &ptr, 0 );
+            fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, aSources[i].Name().c_str() );
+            return -1;
+        }
+
+        if( strcmp( part.name, "parameter" ) == 0 )
+        {
+            len = make_param_block( fp_in, &buffer[0], aSources[i].member.empty() ? ~uint64_t(0) : aSources[i].len );
+
+            fwrite( &buffer[0], 1, len, fp );
+            crc = rkcrc_update( crc, &buffer[0], len );
+        }
+        else
+        {
+            size_t          got;
+            VERITY::Hasher  hasher( &aVerity[i] );
+
+            while( len < part.part_bytecount &&
+                   ( got = read_payload( fp_in, aSources[i], len, &buffer[0],
+                                         std::min<uint64_t>( buffer.size(), part.part_bytecount - len ) ) ) != 0 )
+            {
+                fwrite( &buffer[0], 1, got, fp );
+                crc = crc_skip_zeros( crc, &buffer[0], got );
+                hasher.Feed( len, &buffer[0], got );
+                len += got;
+            }
+
+            hasher.Pad();
+        }
+
+        fclose( fp_in );
+
+        if( len != part.part_bytecount )
+        {
+            fprintf( stderr, "%s: input file '%s' shrank while packing\n", __func__, aSources[i].Name().c_str() );
+            return -1;
+        }
+
+        put_zeros( fp, part.padded_size - len, &crc );
+        pos = part.part_offset + part.padded_size;
+    }
+
+    put_zeros( fp, aImageLen - pos, &crc );
+
+    printf( "Adding CRC...\n" );
+
+    if( fwrite( &crc, 1, sizeof(crc), fp ) != sizeof(crc) || fflush( fp ) )
+    {
+        fprintf( stderr, "%s: error writing output: %s\n", __func__, strerror( errno ) );
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Function prepare_pack
+ * reads the parameter and package-file of srcdir and works out everything
+ * about the image aJob is to write, except for the part CRCs: the header,
+ * where each payload comes from and, if possible, the layout.
+ */
+static int prepare_pack( const char* srcdir, PACK_JOB* aJob )
+{
+    char    buf[4096];
+
+    printf( "------ PACKAGE ------\n" );
+
+    // anything not in this parameter file keeps its default
+    Parameters = PARAMETERS();
+    Partitions.clear();
+
+    snprintf( buf, sizeof(buf), "%s/%s", srcdir, "parameter" );
+
+    if( parse_parameter( buf ) )
+        return -1;
+
+    snprintf( buf, sizeof(buf), "%s/%s", srcdir, "package-file" );
+
+    if( Packages.GetPackages( buf ) )
+        return -1;
+
+    IMAGE&      image = aJob->image;
+    SOURCES&    sources = aJob->sources;        // left empty for SELF and RESERVED
+    TAR_MEMBERS members;
+
+    image.parts.resize( Packages.size() );      // zeroed
+    sources.resize( Packages.size() );
+
+    if( TarFile && read_tar_index( TarFile, &members ) )
+        return -1;
+
+    for( unsigned i = 0;  i < Packages.size();  ++i )
+    {
+        if( Packages[i].name.size() > sizeof( image.parts[i].name ) )
+        {
+            fprintf( stderr, "%s: package name '%s' is too long by %zu bytes\n",
+                __func__,
+                Packages[i].name.c_str(),
+                Packages[i].name.size() - sizeof( image.parts[i].name )
+                );
+
+            return -4;
+        }
+
+        if( Packages[i].fullpath.size( ) > sizeof( image.parts[i].fullpath ) )
+        {
+            fprintf( stderr, "%s: package fullpath '%s' is too long by %zu bytes\n",
+                __func__,
+                Packages[i].fullpath.c_str(),
+                Packages[i].fullpath.size( ) - sizeof( image.parts[i].fullpath )
+                );
+
+            return -5;
+        }
+
+        strncpy( image.parts[i].name, Packages[i].name.c_str(), sizeof(image.parts[i].name) );
+        strncpy( image.parts[i].fullpath, Packages[i].fullpath.c_str(), sizeof(image.parts[i].fullpath) );
+
+        if( Packages[i].fullpath == "SELF" ||
+            Packages[i].fullpath == "RESERVED" )
+        {
+            printf( "Skipping content: %s\n", Packages[i].fullpath.c_str() );
+            continue;
+        }
+
+        TAR_MEMBERS::const_iterator member = members.find( Packages[i].fullpath );
+
+        if( member != members.end() )
+            sources[i] = member->second;
+        else
+        {
+            snprintf( buf, sizeof(buf), "%s/%s", srcdir, image.parts[i].fullpath );
+            sources[i] = SOURCE( buf );
+        }
+
+        printf( "Adding partition: %-24s  using: %s\n", image.parts[i].name, sources[i].Name().c_str() );
+
+        PARTITION* p = Partitions.FindByName( Packages[i].name );
+
+        if( p )
+        {
+            image.parts[i].flash_offset = p->sector_start;
+            image.parts[i].flash_size   = p->sector_count;
+        }
+        else
+        {
+            image.parts[i].flash_offset = ~0;
+            image.parts[i].flash_size   = 0;
+        }
+    }
+
+    strncpy( image.head.manufacturer, Parameters.manufacturer.c_str(), sizeof(image.head.manufacturer) );
+    strncpy( image.head.model, Parameters.machine_model.c_str(), sizeof(image.head.model) );
+    strncpy( image.head.id, Parameters.machine_id.c_str(), sizeof(image.head.id) );
+
+    image.head.version = Parameters.version;
+
+    for( unsigned i = 0; i < sources.size() && Ext4Free; ++i )
+    {
+        if( sources[i].empty() || strcmp( image.parts[i].name, "parameter" ) == 0 )
+            continue;
+
+        uint64_t unused = ext4_unused( &sources[i] );
+
+        if( unused )
+            printf( "Skipping free:    %-24s  %" PRIu64 " MiB of ext4 free blocks\n",
+                image.parts[i].name, unused >> 20 );
+    }
+
+    // When every partition's size is known up front the image can be written
+    // in parallel, else it has to be streamed.
+    aJob->len = layout_packages( image, sources );
+
+    // -verity partitions, each with the partition which copies its payload,
+    // which is another one if layout_packages() shared it
+    aJob->verity.assign( image.parts.size(), VERITY() );
 
-            ptr = strchr( ptr, '@' );
+    for( unsigned v = 0; v < VerityParts.size(); ++v )
+    {
+        unsigned i = 0;
 
-            if( !ptr )
-                continue;
+        while( i < Packages.size() && Packages[i].name != VerityParts[v] )
+            ++i;
 
-            ++ptr;
+        unsigned j = i;
 
-            unsigned sector_start = strtoul( ptr, &ptr, 0 );
+        for( unsigned k = 0; i < Packages.size() && sources[j].empty() && k < image.parts.size(); ++k )
+        {
+            if( !sources[k].empty() && image.parts[k].part_offset == image.parts[i].part_offset &&
+                image.parts[k].part_bytecount == image.parts[i].part_bytecount )
+            {
+                j = k;
+            }
+        }
 
-            for( ; *ptr && *ptr != '('; ptr++ )
-                ;
+        if( i == Packages.size() || sources[j].empty() || Packages[i].name == "parameter" )
+        {
+            fprintf( stderr, "%s: -verity '%s' is not a partition with a payload\n",
+                __func__, VerityParts[v].c_str() );
+            return -1;
+        }
 
-            ++ptr;
+        // only known here when the layout is, else write_verity() finds out
+        if( aJob->len && !image.parts[j].part_bytecount )
+        {
+            fprintf( stderr, "%s: -verity '%s' is an empty partition\n",
+                __func__, VerityParts[v].c_str() );
+            return -1;
+        }
 
-            char* name_start = ptr;
+        aJob->verity[j].on = true;
+        aJob->trees.push_back( std::make_pair( Packages[i].name, j ) );
+    }
 
-            int i;
-            for( i = 0; i < sizeof( ((PARTITION*)0)->name) && *ptr && *ptr != ')'; ++i )
-                ++ptr;
+    for( unsigned g = 0; g < GunzipParts.size(); ++g )
+    {
+        unsigned i = 0;
 
-            std::string name( name_start, i );
+        while( i < Packages.size() && Packages[i].name != GunzipParts[g] )
+            ++i;
 
-            Partitions.push_back( PARTITION( name, sector_start, sector_count ) );
+        if( i == Packages.size() || sources[i].empty() || Packages[i].name == "parameter" )
+        {
+            fprintf( stderr, "%s: -gunzip '%s' is not a partition with an input file\n",
+                __func__, GunzipParts[g].c_str() );
+            return -1;
         }
     }
 
@@ -519,540 +3766,594 @@ int PARTITIONS::Parse( char* str )
 }
 
 
-int action_parse_key( char* key, char* value )
+/**
+ * Function write_trees
+ * writes the dm-verity trees of aJob next to its image, or to the current
+ * directory if aToStdout.
+ */
+static int write_trees( const PACK_JOB& aJob, bool aToStdout )
 {
     int ret = 0;
 
-    if( strcmp( key, "FIRMWARE_VER" ) == 0 )
-    {
-        unsigned a, b, c;
-
-        sscanf( value, "%d.%d.%d", &a, &b, &c );
-        Parameters.version = ROM_VERSION( a, b, c );
-    }
-    else if( strcmp( key, "MACHINE_MODEL" ) == 0 )
-    {
-        Parameters.machine_model = value;
-    }
-    else if( strcmp( key, "MACHINE_ID" ) == 0 )
-    {
-        Parameters.machine_id = value;
-    }
-    else if( strcmp( key, "MANUFACTURER" ) == 0 )
-    {
-        Parameters.manufacturer = value;
-    }
-    else if( strcmp( key, "CMDLINE" ) == 0 )
+    for( unsigned t = 0; t < aJob.trees.size() && !ret; ++t )
     {
-        char*   token1 = NULL;
-        char*   param = strtok_r( value, " ", &token1 );
-
-        while( param )
-        {
-            char*   param_key = param;
-            char*   param_value = strchr( param, '=' );
-
-            if( param_value )
-            {
-                *param_value++ = '\0';
-
-                if( strcmp( param_key, "mtdparts" ) == 0 )
-                {
-                    ret = Partitions.Parse( param_value );
-                }
-            }
+        const std::string&  name = aJob.trees[t].first;
+        std::string         path = aToStdout ? name + ".verity" : aJob.dstfile + "." + name + ".verity";
 
-            param = strtok_r( NULL, " ", &token1 );
-        }
+        ret = write_verity( aJob.verity[aJob.trees[t].second], name.c_str(), path );
     }
 
     return ret;
 }
 
 
-int parse_parameter( const char* fname )
+/**
+ * Function pack_update
+ * packs the partitions listed in srcdir's package-file into image file
+ * dstfile.  A dstfile of "-" streams the image to stdout, which then no
+ * longer carries the messages; they go to stderr.
+ */
+int pack_update( const char* srcdir, const char* dstfile )
 {
-    int     ret = 0;
-    char    line[4096];
-
-    FILE*   fp = fopen( fname, "r" );
-
-    if( !fp )
-    {
-        printf( "Can't open file: %s\n", fname );
-        return -1;
-    }
+    int         ret = 0;
+    FILE*       fp_pipe = NULL;
+    PACK_JOB    job;
 
-    while( fgets( line, sizeof(line), fp ) != NULL )
+    if( strcmp( dstfile, "-" ) == 0 )
     {
-        char*   startp = line;
-        char*   endp   = line + strlen( line ) - 1;
-
-        // skip UTF-8 BOM only in first line
-        if( startp[0] == (char)0xEF && startp[1] == (char)0xBB && startp[2] == (char)0xBF)
-            startp += 3;
+        fflush( stdout );
+        fp_pipe = fdopen( dup( STDOUT_FILENO ), "wb" );
+        dup2( STDERR_FILENO, STDOUT_FILENO );
 
-        if( *endp != '\n' && *endp != '\r' && !feof( fp ) )
+        if( !fp_pipe )
         {
-            fprintf( stderr, "parameter file has a very long line that I cannot handle!\n" );
-            ret = -3;
-            break;
+            fprintf( stderr, "%s: can't write to stdout: %s\n", __func__, strerror( errno ) );
+            return -1;
         }
+    }
 
-        while( endp > startp && isspace( *endp ) )
-            *endp-- = 0;
-
-        // trim line
-        while( *startp && isspace( *startp ) )
-            ++startp;
-
-        if( *startp == '#' || *startp == 0 )
-            continue;
+    job.dstfile = dstfile;
 
-        char*   key   = startp;
-        char*   value = strchr( startp, ':' );
+    ret = prepare_pack( srcdir, &job );
 
-        if( !value )
-            continue;
+    if( ret )
+        return ret;
 
-        *value++ = 0;
+    if( fp_pipe && !job.len )
+    {
+        fprintf( stderr, "%s: packing to stdout needs every input to be an uncompressed regular file\n", __func__ );
+        ret = -1;
+    }
+    else if( fp_pipe )
+        ret = pack_pipe( fp_pipe, job.image, job.sources, job.verity, job.len );
+    else if( job.len )
+        ret = pack_parallel( std::vector<PACK_JOB*>( 1, &job ) );
+    else
+        ret = pack_stream( dstfile, job.image, job.sources, job.verity );
 
-        while( *value && isspace( *value ) )
-            ++value;
+    if( !ret )
+        ret = write_trees( job, fp_pipe != NULL );
 
-        action_parse_key( key, value );
+    if( fp_pipe && fclose( fp_pipe ) && !ret )
+    {
+        fprintf( stderr, "%s: error writing output: %s\n", __func__, strerror( errno ) );
+        ret = -1;
     }
 
-    if( fp )
-        fclose( fp );
+    if( !ret )
+        printf( "------ OK ------\n\n" );
 
     return ret;
 }
 
 
-int PACKAGES::GetPackages( const char* fname )
+/**
+ * Function pack_batch
+ * packs every image listed in aManifest, one "src_dir out_img" pair per line,
+ * in one go.  An input used by several of them, the same file at the same
+ * offset, is read once by pack_parallel(), which copies it into each image
+ * and computes its CRC once.  An image whose layout can't be known ahead is
+ * packed on its own by pack_stream() afterwards.
+ */
+int pack_batch( const char* aManifest )
 {
     int     ret = 0;
-    char    line[4096];
-
-    clear();
+    char    line[8192];
+    char    src[4096];
+    char    dst[4096];
 
-    FILE*   fp = fopen( fname, "r" );
+    FILE* fp = fopen( aManifest, "r" );
 
     if( !fp )
     {
-        fprintf( stderr, "%s: can't open file '%s'\n", __func__, fname );
-        fprintf( stderr, "Every project needs a 'package-list' file in the source directory\n" );
+        fprintf( stderr, "%s: can't open file '%s'\n", __func__, aManifest );
         return -1;
     }
 
-    while( fgets( line, sizeof(line), fp ) != NULL )
-    {
-        char*   startp = line;
-        char*   endp = line + strlen( line ) - 1;
+    std::deque<PACK_JOB>    jobs;
 
-        if( *endp != '\n' && *endp != '\r' && !feof( fp ) )
-        {
-            fprintf( stderr,
-                "File '%s' has a line which is too long for me, sorry!\n", fname );
-            ret = -3;
-            break;
-        }
+    for( unsigned n = 1; !ret && fgets( line, sizeof(line), fp ); ++n )
+    {
+        char* startp = line;
 
-        // trim line
         while( isspace( *startp ) )
             ++startp;
 
-        while( isspace( *endp ) )
-            --endp;
-
-        endp[1] = 0;
-
         if( *startp == '#' || *startp == 0 )
             continue;
 
-        char* name = startp;
-
-        while( *startp && *startp != ' ' && *startp != '\t' )
-            startp++;
+        char extra;
 
-        while( *startp == ' ' || *startp == '\t' )
+        if( sscanf( startp, "%4095s %4095s %c", src, dst, &extra ) != 2 || strcmp( dst, "-" ) == 0 )
         {
-            *startp = '\0';
-            startp++;
+            fprintf( stderr, "%s: line %u of '%s' is not \"src_dir out_img\"\n", __func__, n, aManifest );
+            ret = -1;
+            break;
         }
 
-        char* path = startp;
+        jobs.emplace_back();
+        jobs.back().dstfile = dst;
 
-        push_back( PACKAGE( name, path ) );
+        ret = prepare_pack( src, &jobs.back() );
     }
 
     fclose( fp );
 
+    std::vector<PACK_JOB*>  parallel;
+
+    for( unsigned j = 0; j < jobs.size(); ++j )
+    {
+        if( jobs[j].len )
+            parallel.push_back( &jobs[j] );
+    }
+
+    if( !ret && !parallel.empty() )
+        ret = pack_parallel( parallel );
+
+    for( unsigned j = 0; j < jobs.size() && !ret; ++j )
+    {
+        if( !jobs[j].len )
+            ret = pack_stream( jobs[j].dstfile.c_str(), jobs[j].image, jobs[j].sources, jobs[j].verity );
+    }
+
+    for( unsigned j = 0; j < jobs.size() && !ret; ++j )
+        ret = write_trees( jobs[j], false );
+
+    if( !ret )
+        printf( "------ OK ------\n\n" );
+
     return ret;
 }
 
 
 /**
- * Function import_package
- * copies an external file into this update image.
+ * Function zero_range
+ * makes aLen bytes of fp at aPos read as zeros, punching a hole where the
+ * file system can, else writing them.
  */
-int import_package( FILE* fp_update, UPDATE_PART* pack, const char* path )
+static void zero_range( FILE* fp, uint64_t aPos, uint64_t aLen )
 {
-    int     ret = 0;
-    char    buf[2048];      // must be 2048 for param part
-    size_t  readlen;
-    off_t   part_offset = ftello( fp_update );
+    uint32_t crc = 0;
 
-    if( part_offset > uint32_t( ~0 ) )
-    {
-        fprintf( stderr,
-            "%s: partion file %s makes output archive too big.\n",
-            __func__, path );
-        return -2;
-    }
+    if( !aLen )
+        return;
 
-    pack->part_offset = part_offset;
+    fflush( fp );
 
-    FILE*   fp_in = fopen( path, "rb" );
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if( fallocate( fileno( fp ), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, aPos, aLen ) == 0 )
+        return;
+#endif
 
-    if( !fp_in )
+    fseeko( fp, aPos, SEEK_SET );
+    put_zeros( fp, aLen, &crc );
+}
+
+
+/**
+ * Function update_image
+ * replaces the payloads of some partitions of an existing image, each given
+ * as "name=file" in aArgs, without repacking the rest.  A new payload goes
+ * in place when its slot is not shared and it fits, or is the last one in
+ * the image, else it is appended and the old slot zeroed.  The image CRC is
+ * assembled with image_crc() from the part CRCs, so only the new payloads
+ * are read.  An image without a PART_CRCS table is read once to find its
+ * part CRCs, which are then stored.
+ */
+int update_image( const char* imgfile, const std::vector<std::string>& aArgs )
+{
+    IMAGE       image;
+    uint32_t    crc_read = 0;
+    uint32_t    header_crc;
+    int         ret;
+
+    FILE* fp = fopen( imgfile, "r+b" );
+
+    if( !fp )
     {
-        fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, path );
+        fprintf( stderr, "%s: can't open file '%s': %s\n", __func__, imgfile, strerror( errno ) );
         return -1;
     }
 
-    if( strcmp( pack->name, "parameter" ) == 0 )
-    {
-        uint32_t crc = 0;
-        PARAM_HEADER* header = (PARAM_HEADER*) buf;
+    ret = image.Read( fp, &header_crc );
 
-        memcpy( header->magic, "PARM", sizeof(header->magic) );
+    if( ret )
+    {
+        fprintf( stderr, "%s: '%s' is not an update image\n", __func__, imgfile );
+        fclose( fp );
+        return ret;
+    }
 
-        readlen = fread( buf + sizeof(*header), 1,
-                        sizeof(buf) - sizeof(*header) - sizeof(crc), fp_in );
+    const uint64_t  orig_len = image.head.length;
 
-        header->length = readlen;
-        RKCRC( crc, buf + sizeof(*header), readlen );
+    fseeko( fp, 0, SEEK_END );
 
-        readlen += sizeof(*header);
+    if( uint64_t( ftello( fp ) ) != orig_len + 4 ||
+        fseeko( fp, orig_len, SEEK_SET ) || fread( &crc_read, 1, sizeof(crc_read), fp ) != sizeof(crc_read) )
+    {
+        fprintf( stderr, "%s: update_header.length of '%s' does not match its size\n", __func__, imgfile );
+        fclose( fp );
+        return -2;
+    }
 
-        memcpy( buf + readlen, &crc, sizeof(crc) );
-        readlen += sizeof(crc);
-        memset( buf + readlen, 0, sizeof(buf) - readlen );
+    if( !image.has_crcs )
+    {
+        std::vector<RANGE>      ranges;
+        std::vector<unsigned>   range_part;
+        std::vector<uint32_t>   crcs;
+        EXTRACTS                none;
 
-        fwrite( buf, 1, sizeof(buf), fp_update );
+        printf( "No partition CRCs in '%s', reading it once for them\n", imgfile );
 
-        pack->part_bytecount  += readlen;
-        pack->padded_size += sizeof(buf);
-    }
-    else
-    {
-        while( (readlen = fread( buf, 1, sizeof(buf), fp_in )) != 0 )
+        for( unsigned i = 0; i < image.parts.size(); ++i )
         {
-            if( readlen < sizeof(buf) )
-                memset( buf + readlen, 0, sizeof(buf) - readlen );
+            UPDATE_PART64& part = image.parts[i];
 
-            fwrite( buf, 1, sizeof(buf), fp_update );
+            if( strcmp( part.fullpath, "SELF" ) && strcmp( part.fullpath, "RESERVED" ) &&
+                part.part_offset + part.part_bytecount <= orig_len )
+            {
+                RANGE r = { part.part_offset, part.part_bytecount };
 
-            pack->part_bytecount += readlen;
-            pack->padded_size    += sizeof(buf);
+                ranges.push_back( r );
+                range_part.push_back( i );
+            }
         }
-    }
-
-    fclose( fp_in );
 
-    return 0;
-}
-
-
-void append_crc( FILE* fp )
-{
-    fseeko( fp, 0, SEEK_END );
-
-    off_t file_len = ftello( fp );
+        if( unpack_pass( fileno( fp ), ranges, none, &crcs ) )
+        {
+            fclose( fp );
+            return -1;
+        }
 
-    if( file_len == (off_t) -1 )
-        return;
+        for( unsigned r = 0; r < ranges.size(); ++r )
+            image.parts[range_part[r]].crc = crcs[r];
 
-    fseeko( fp, 0, SEEK_SET );
+        image.has_crcs = true;
+    }
 
-    printf( "Adding CRC...\n" );
+    // the CRCs must account for every byte, else the rest is not zeros
+    if( image_crc( image, header_crc, orig_len ) != crc_read )
+    {
+        fprintf( stderr, "%s: the CRC of '%s' does not follow from its partitions, "
+            "it is damaged or holds data outside of them\n", __func__, imgfile );
+        fclose( fp );
+        return -1;
+    }
 
-    uint32_t crc = filestream_crc( fp, file_len );
+    // check every argument before anything is written
+    std::vector<unsigned>   targets;
 
-    fseeko( fp, 0, SEEK_END );
-    fwrite( &crc, 1, sizeof(crc), fp );
-}
+    for( unsigned a = 0; a < aArgs.size(); ++a )
+    {
+        size_t      eq = aArgs[a].find( '=' );
+        std::string name = aArgs[a].substr( 0, eq );
+        unsigned    i = 0;
 
+        while( i < image.parts.size() && name != std_string( image.parts[i].name, sizeof(image.parts[i].name) ) )
+            ++i;
 
-typedef std::map< std::string, unsigned >   PAD_MAP;
+        if( eq == std::string::npos || i == image.parts.size() ||
+            !strcmp( image.parts[i].fullpath, "SELF" ) || !strcmp( image.parts[i].fullpath, "RESERVED" ) )
+        {
+            fprintf( stderr, "%s: '%s' is not name=file for a partition with a payload\n",
+                __func__, aArgs[a].c_str() );
+            ret = -3;
+        }
+        else if( std::find( targets.begin(), targets.end(), i ) != targets.end() )
+        {
+            // its stale ranges could overlap the payload written the second time
+            fprintf( stderr, "%s: partition '%s' is given more than once\n", __func__, name.c_str() );
+            ret = -3;
+        }
+        else if( access( aArgs[a].c_str() + eq + 1, R_OK ) )
+        {
+            fprintf( stderr, "%s: cannot open input file '%s'\n", __func__, aArgs[a].c_str() + eq + 1 );
+            ret = -1;
+        }
 
-static unsigned find_in_map( const std::string& aName, const PAD_MAP& aMap )
-{
-    PAD_MAP::const_iterator it = aMap.find( aName );
+        targets.push_back( i );
+    }
 
-    if( it == aMap.end() )
-        return 0;
+    if( ret )
+    {
+        fclose( fp );
+        return ret;
+    }
 
-    return it->second;
-}
+    std::vector<RANGE>  stale;      // zeroed once every new payload is written
+    bool                moved = false;
+    bool                damaged = false;    // written in place, so no way back
 
+    for( unsigned a = 0; a < aArgs.size() && !ret; ++a )
+    {
+        unsigned        i = targets[a];
+        UPDATE_PART64&  part = image.parts[i];
+        SOURCE          src( aArgs[a].substr( aArgs[a].find( '=' ) + 1 ) );
+        struct stat     st;
+        bool            shared = false;
 
-// convert bytes to 512 byte sectors
-#define BYTES2SECTORS(x)        unsigned((uint64_t(x)+511)/512)
-#define MBYTES(x)               ( uint64_t(x)*1024*1024)
-#define GBYTES(x)               ( uint64_t(x)*1024*1024*1024)
+        for( unsigned j = 0; j < image.parts.size(); ++j )
+        {
+            shared = shared || ( j != i && image.parts[j].part_bytecount &&
+                                 image.parts[j].part_offset == part.part_offset &&
+                                 strcmp( image.parts[j].fullpath, "SELF" ) );
+        }
 
+        // room needed, if it can be known before the copy
+        uint64_t need = ~uint64_t(0);
 
-unsigned partition_constraints( unsigned aSize, const std::string& aPartitionName )
-{
-    // tables of bootloader partion names and sizes
+        if( !strcmp( part.name, "parameter" ) )
+            need = align_up( PART_BLOCK );
+        else if( stat( src.path.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) && !gunzip_part( part.name ) )
+            need = align_up( ( st.st_size + PART_BLOCK - 1 ) / PART_BLOCK * PART_BLOCK );
 
-    // minimums:
-    // partition may not be smaller than this.
-    static const PAD_MAP minimums = {
-        { "bootloader",     BYTES2SECTORS( MBYTES(1) ) },            // 1*1024*1024 = a megabyte
-        { "boot",           BYTES2SECTORS( MBYTES(16) ) },
+        bool last     = part.part_offset + part.padded_size >= image.head.length;
+        bool in_place = !shared && need != ~uint64_t(0) && ( last || need <= part.padded_size );
 
-        // This is a hack for my 32 gbyte emmc, gives me a 6 gbyte swap
-        // partition without having to supply an image file.
-        { "swap",           BYTES2SECTORS( GBYTES(6)) },
-    };
+        if( in_place && last && !image.extended && part.part_offset + need > uint32_t(~0) )
+            in_place = false;       // the append below is checked by Fits()
 
-    // paddings:
-    // to add to the end of respective parition's input file size.
-    static const PAD_MAP paddings = {
-        { "bootloader",     BYTES2SECTORS( MBYTES(1) ) },
-        { "recover-script", BYTES2SECTORS( MBYTES(1) ) },
-        { "linuxroot",      BYTES2SECTORS( MBYTES(5) ) },
-    };
+        UPDATE_PART64   updated = part;
+        uint32_t        crc = 0;
 
-    aSize += find_in_map( aPartitionName, paddings );
+        updated.part_bytecount = 0;
+        updated.padded_size    = 0;
 
-    unsigned minimum = find_in_map( aPartitionName, minimums );
+        fseeko( fp, in_place ? part.part_offset : align_up( std::max( image.head.length, orig_len + 4 ) ), SEEK_SET );
 
-    if( aSize < minimum )
-        aSize = minimum;
+        damaged = damaged || in_place;
+        ret = import_package( fp, &updated, src, &crc, NULL );
 
-    return aSize;           // return value is in 512 byte sized "sectors".
-}
+        if( ret )
+            break;
 
+        if( in_place && !last )
+        {
+            // keep the slot, zeroing what is left of the old payload
+            RANGE r = { updated.part_offset + updated.padded_size, part.padded_size - updated.padded_size };
 
-int compute_cmdline( const char* srcdir )
-{
-    char    buf[4096];
+            stale.push_back( r );
+            updated.padded_size = part.padded_size;
+        }
+        else if( !in_place && !shared )
+        {
+            RANGE r = { part.part_offset, part.padded_size };
 
-    snprintf( buf, sizeof(buf), "%s/%s", srcdir, "package-file" );
+            stale.push_back( r );
+        }
+        else if( updated.part_offset + updated.padded_size < image.head.length )
+        {
+            // the last payload shrank, what it left behind may end up inside
+            // the image if something is appended after it
+            RANGE r = { updated.part_offset + updated.padded_size,
+                        image.head.length - ( updated.part_offset + updated.padded_size ) };
 
-    if( Packages.GetPackages( buf ) )
-        return -1;
+            stale.push_back( r );
+        }
 
-    struct stat st;
+        moved = moved || !in_place;
 
-    fprintf( stderr, "fragment for CMDLINE:\n" );
+        if( !in_place || last )
+            image.head.length = updated.part_offset + updated.padded_size;
 
-    printf( "mtdparts=rk29xxnand:" );
+        printf( "Replaced partition: %-24s  %s, %s\n", part.name, src.Name().c_str(),
+            in_place ? "in place" : "appended" );
 
-    // The contents of the package-list file drive this loop.
-    // All offsets and sizes are in units of 512 bytes, i.e. a sector.
+        part = updated;
+    }
 
-    unsigned flash_offset = 0x2000;     // start of flash allocation in sectors
-    for( unsigned i=0; i < Packages.size();  ++i )
+    std::string error;
+
+    finish_header( image, image.head.length );
+
+    if( !ret && !image.Fits( &error ) )
     {
-        int failed = stat( Packages[i].fullpath.c_str(), &st );
+        fprintf( stderr, "%s: %s\n", __func__, error.c_str() );
+        ret = -2;
+    }
 
-        if( failed )
-            st.st_size = 0;
+    if( ret )
+    {
+        // drop what was appended, the old trailer is still in place
+        fflush( fp );
+        ftruncate( fileno( fp ), orig_len + 4 );
+        fclose( fp );
 
-        unsigned file_sectors = BYTES2SECTORS( st.st_size );
+        if( damaged )
+            fprintf( stderr, "%s: '%s' is left damaged, repack it\n", __func__, imgfile );
 
-        file_sectors = partition_constraints( file_sectors, Packages[i].name );
+        return ret;
+    }
 
-        if( failed &&
-            Packages[i].fullpath != "RESERVED" &&
-            Packages[i].name != "swap" )
-        {
-            fprintf( stderr,
-                "%s: unable to open '%s' partition's file '%s'\n",
-                __func__,
-                Packages[i].name.c_str(),
-                Packages[i].fullpath.c_str()
-                );
-            return -2;
-        }
+    if( moved )
+    {
+        RANGE r = { orig_len, 4 };      // the old CRC, now inside the image
 
-        unsigned cur_flash_sectors = file_sectors;      // partition size in sectors
-        unsigned cur_flash_offset  = flash_offset;      // partition offset in sectors
+        stale.push_back( r );
+    }
 
-        flash_offset += cur_flash_sectors;
+    for( unsigned r = 0; r < stale.size(); ++r )
+        zero_range( fp, stale[r].offset, stale[r].len );
 
-        if( i )
-            printf( "," );
+    std::vector<char>   header = image.Bytes();
+    uint32_t            crc = image_crc( image, rkcrc_update( 0, &header[0], header.size() ), image.head.length );
 
-        D( fprintf( stderr,
-            "name:%-12s cur_flash_sectors:0x%x cur_flash_offset:0x%0x\n",
-            Packages[i].name.c_str(),
-            cur_flash_sectors, cur_flash_offset
-            ); )
+    fflush( fp );
 
-        if( i == Packages.size()-1 )
-        {
-            // The last linux partition is set to expand on first boot using the
-            // '-' size field, so make sure of this partition name in your
-            // "package-file".  For linux it's sensibly "linuxroot".
-            printf( "-@0x%x(%s)",
-                cur_flash_offset,
-                Packages[i].name.c_str()
-                );
-        }
-        else
-        {
-            printf( "0x%x@0x%x(%s)",
-                cur_flash_sectors,
-                cur_flash_offset,
-                Packages[i].name.c_str()
-                );
-        }
+    if( pwrite( fileno( fp ), &header[0], header.size(), 0 ) != (ssize_t) header.size() ||
+        pwrite( fileno( fp ), &crc, sizeof(crc), image.head.length ) != sizeof(crc) ||
+        ftruncate( fileno( fp ), image.head.length + 4 ) )
+    {
+        fprintf( stderr, "%s: error writing '%s': %s\n", __func__, imgfile, strerror( errno ) );
+        ret = -1;
     }
 
-    printf( "\n" );
+    if( fclose( fp ) && !ret )
+    {
+        fprintf( stderr, "%s: error writing '%s': %s\n", __func__, imgfile, strerror( errno ) );
+        ret = -1;
+    }
 
-    return 0;
+    return ret;
 }
 
 
-int pack_update( const char* srcdir, const char* dstfile )
+/**
+ * Function set_meta
+ * changes header fields of an existing image, each given in aArgs as
+ * KEY=value with the keys of the parameter file: FIRMWARE_VER, MACHINE_MODEL,
+ * MACHINE_ID or MANUFACTURER.  Only the header bytes are patched.  The CRC is
+ * linear, starting from 0 without a final xor, so the trailing CRC changes by
+ * the CRC of the xor of old and new header, advanced over the rest of the
+ * image with rkcrc_zeros().  Nothing past the header is read.
+ */
+int set_meta( const char* imgfile, const std::vector<std::string>& aArgs )
 {
-    int     ret = 0;
-    char    buf[4096];
+    IMAGE       image;
+    uint32_t    crc_read;
+    uint32_t    header_crc;
 
-    printf( "------ PACKAGE ------\n" );
-
-    snprintf( buf, sizeof(buf), "%s/%s", srcdir, "parameter" );
+    FILE* fp = fopen( imgfile, "r+b" );
 
-    if( parse_parameter( buf ) )
+    if( !fp )
+    {
+        fprintf( stderr, "%s: can't open file '%s': %s\n", __func__, imgfile, strerror( errno ) );
         return -1;
+    }
 
-    snprintf( buf, sizeof(buf), "%s/%s", srcdir, "package-file" );
+    int ret = image.Read( fp, &header_crc );
 
-    if( Packages.GetPackages( buf ) )
-        return -1;
+    if( ret )
+    {
+        fprintf( stderr, "%s: '%s' is not an update image\n", __func__, imgfile );
+        fclose( fp );
+        return ret;
+    }
 
-    FILE* fp_update = fopen( dstfile, "wb+" );
+    // as in the file, so bytes this tool does not model are kept
+    std::vector<char>   before( image.extended ? sizeof(UPDATE_HEADER64) : sizeof(UPDATE_HEADER) );
+    uint64_t            len = image.head.length;
+    struct stat         st;
 
-    if( !fp_update )
+    if( fstat( fileno( fp ), &st ) || uint64_t( st.st_size ) != len + 4 ||
+        pread( fileno( fp ), &before[0], before.size(), 0 ) != (ssize_t) before.size() ||
+        pread( fileno( fp ), &crc_read, sizeof(crc_read), len ) != sizeof(crc_read) )
     {
-        fprintf( stderr, "Can't open file \"%s\": %s\n", dstfile, strerror( errno ) );
-        return -1;
+        fprintf( stderr, "%s: update_header.length of '%s' does not match its size\n", __func__, imgfile );
+        fclose( fp );
+        return -2;
     }
 
-    UPDATE_HEADER header;
+    struct FIELD
+    {
+        const char* key;
+        size_t      offset;
+        size_t      size;
+    };
 
-    memset( &header, 0, sizeof(header) );
+    const FIELD fields[] = {
+        { "FIRMWARE_VER",  image.extended ? offsetof( UPDATE_HEADER64, version ) : offsetof( UPDATE_HEADER, version ),
+                           sizeof(uint32_t) },
+        { "MACHINE_MODEL", image.extended ? offsetof( UPDATE_HEADER64, model ) : offsetof( UPDATE_HEADER, model ),
+                           sizeof(image.head.model) },
+        { "MACHINE_ID",    image.extended ? offsetof( UPDATE_HEADER64, id ) : offsetof( UPDATE_HEADER, id ),
+                           sizeof(image.head.id) },
+        { "MANUFACTURER",  image.extended ? offsetof( UPDATE_HEADER64, manufacturer ) : offsetof( UPDATE_HEADER, manufacturer ),
+                           sizeof(image.head.manufacturer) },
+    };
 
-    // put out an inaccurate place holder, planning to come back later and update it.
-    fwrite( &header, sizeof(header), 1, fp_update );
+    std::vector<char>   after = before;
 
-    unsigned i;
-    for( i=0;  i < Packages.size() && i<16;  ++i )
+    for( unsigned a = 0; a < aArgs.size() && !ret; ++a )
     {
-        if( Packages[i].name.size() > sizeof( header.parts[i].name ) )
-        {
-            fprintf( stderr, "%s: package name '%s' is too long by %zu bytes\n",
-                __func__,
-                Packages[i].name.c_str(),
-                Packages[i].name.size() - sizeof( header.parts[i].name )
-                );
+        size_t      eq = aArgs[a].find( '=' );
+        std::string key = aArgs[a].substr( 0, eq );
+        std::string value = eq == std::string::npos ? "" : aArgs[a].substr( eq + 1 );
+        unsigned    f = 0;
 
-            return -4;
-        }
+        while( f < sizeof(fields) / sizeof(fields[0]) && key != fields[f].key )
+            ++f;
 
-        if( Packages[i].fullpath.size( ) > sizeof( header.parts[i].fullpath ) )
+        if( eq == std::string::npos || f == sizeof(fields) / sizeof(fields[0]) )
         {
-            fprintf( stderr, "%s: package fullpath '%s' is too long by %zu bytes\n",
-                __func__,
-                Packages[i].fullpath.c_str(),
-                Packages[i].fullpath.size( ) - sizeof( header.parts[i].fullpath )
-                );
-
-            return -5;
+            fprintf( stderr, "%s: '%s' is not FIRMWARE_VER, MACHINE_MODEL, MACHINE_ID "
+                "or MANUFACTURER=value\n", __func__, aArgs[a].c_str() );
+            ret = -3;
         }
-
-        strncpy( header.parts[i].name, Packages[i].name.c_str(), sizeof(header.parts[i].name) );
-        strncpy( header.parts[i].fullpath, Packages[i].fullpath.c_str(), sizeof(header.parts[i].fullpath) );
-
-        if( Packages[i].fullpath == "SELF" ||
-            Packages[i].fullpath == "RESERVED" )
+        else if( fields[f].size == sizeof(uint32_t) )
         {
-            printf( "Skipping content: %s\n", Packages[i].fullpath.c_str() );
-            continue;
-        }
+            unsigned    x, y, z;
 
-        snprintf( buf, sizeof(buf), "%s/%s", srcdir, header.parts[i].fullpath );
-        printf( "Adding partition: %-24s  using: %s\n", header.parts[i].name, buf );
+            if( sscanf( value.c_str(), "%u.%u.%u", &x, &y, &z ) != 3 || x > 255 || y > 255 || z > 0xffff )
+            {
+                fprintf( stderr, "%s: version '%s' is not major.minor.build\n", __func__, value.c_str() );
+                ret = -3;
+            }
+            else
+            {
+                uint32_t version = ROM_VERSION( x, y, z );
 
-        ret = import_package( fp_update, &header.parts[i], buf );
-        if( ret )
-        {
-            break;
+                memcpy( &after[fields[f].offset], &version, sizeof(version) );
+            }
         }
-
-        PARTITION* p = Partitions.FindByName( Packages[i].name );
-
-        if( p )
+        else if( value.size() > fields[f].size )
         {
-            header.parts[i].flash_offset = p->sector_start;
-            header.parts[i].flash_size   = p->sector_count;
+            fprintf( stderr, "%s: %s is too long by %zu bytes\n", __func__, key.c_str(),
+                value.size() - fields[f].size );
+            ret = -3;
         }
         else
         {
-            header.parts[i].flash_offset = ~0;
-            header.parts[i].flash_size   = 0;
+            memset( &after[fields[f].offset], 0, fields[f].size );
+            memcpy( &after[fields[f].offset], value.data(), value.size() );
         }
-    }
-
-    memcpy( header.magic, "RKAF", sizeof(header.magic) );
-    strncpy( header.manufacturer, Parameters.manufacturer.c_str(), sizeof(header.manufacturer) );
-    strncpy( header.model, Parameters.machine_model.c_str(), sizeof(header.model) );
-    strncpy( header.id, Parameters.machine_id.c_str(), sizeof(header.id) );
-
 
-    off_t   filesize = ftello( fp_update );
+        if( !ret )
+            printf( "Setting: %-16s %s\n", key.c_str(), value.c_str() );
+    }
 
-    if( filesize > uint32_t(~0) )
+    if( !ret )
     {
-        fprintf( stderr,
-            "%s: file '%s' header.length needs to be than the 32 bit field can hold\n"
-            " leaving it at zero.\n",
-            __func__,
-            dstfile
-            );
-    }
-    else
-        header.length = filesize;
+        std::vector<char>   delta( before.size() );
 
-    header.num_parts = i;
-    header.version = Parameters.version;
+        for( size_t i = 0; i < delta.size(); ++i )
+            delta[i] = before[i] ^ after[i];
 
-    for( i = 0; i< header.num_parts; ++i )
-    {
-        if( strcmp( header.parts[i].fullpath, "SELF" ) == 0 )
+        uint32_t crc = crc_read ^ rkcrc_zeros( rkcrc_update( 0, &delta[0], delta.size() ), len - delta.size() );
+
+        if( pwrite( fileno( fp ), &after[0], after.size(), 0 ) != (ssize_t) after.size() ||
+            pwrite( fileno( fp ), &crc, sizeof(crc), len ) != sizeof(crc) )
         {
-            header.parts[i].part_bytecount  = header.length + 4;
-            header.parts[i].flash_size = round_up( header.parts[i].part_bytecount );
-            break;
+            fprintf( stderr, "%s: error writing '%s': %s\n", __func__, imgfile, strerror( errno ) );
+            ret = -1;
         }
     }
 
-    fseeko( fp_update, 0, SEEK_SET );
-    fwrite( &header, sizeof(header), 1, fp_update );
-
-    append_crc( fp_update );
-
-    fclose( fp_update );
-
-    printf( "------ OK ------\n\n" );
+    if( fclose( fp ) && !ret )
+    {
+        fprintf( stderr, "%s: error writing '%s': %s\n", __func__, imgfile, strerror( errno ) );
+        ret = -1;
+    }
 
     return ret;
 }
@@ -1061,15 +4362,47 @@ int pack_update( const char* srcdir, const char* dstfile )
 void usage()
 {
     printf( "USAGE:\n"
-            "\t%s -pack    <src_dir> <out_img>\n"
+            "\t%s [options] -pack    <src_dir> <out_img>\n"
+            "\t\t or\n"
+            "\t%s [options] -batch   <manifest>\tpack every \"<src_dir> <out_img>\" line,\n"
+            "\t\t\treading inputs the images share once\n"
+            "\t\t or\n"
+            "\t%s [options] -unpack  <src_img> <out_dir> [partition ...]\n"
+            "\t\t or\n"
+            "\t%s [options] -verify  <src_img> [partition ...]\n"
+            "\t\t or\n"
+            "\t%s [options] -update  <img> <partition>=<file> ...\n"
             "\t\t or\n"
-            "\t%s -unpack  <src_img> <out_dir>\n"
+            "\t%s -set-meta <img> <KEY>=<value> ...\tKEY is FIRMWARE_VER, MACHINE_MODEL,\n"
+            "\t\t\tMACHINE_ID or MANUFACTURER as in the parameter file\n"
             "\t\t or\n"
             "\t%s -CMDLINE <src_dir>\n\n"
+            "Options:\n"
+            "\t-j <jobs>\tworker threads for hashing and extracting, default is one per core\n"
+            "\t-dedup\t\tstore partitions with identical content once, not only identical files\n"
+            "\t-align <bytes>\tstart each partition on this power of two boundary, e.g. 4K or 1M,\n"
+            "\t\t\tdefault is 2048\n"
+            "\t-ext\t\twrite the extended RKAX format: 64 bit offsets, any number of partitions,\n"
+            "\t\t\tnot readable by Rockchip's tools\n"
+            "\t-ext4-free\ttake the blocks an ext4 partition image leaves free as zeros,\n"
+            "\t\t\tso they are neither read nor stored\n"
+            "\t-verity <name>\tbuild the dm-verity SHA-256 hash tree of partition <name> while\n"
+            "\t\t\tpacking, into <out_img>.<name>.verity, may be repeated\n"
+            "\t-gunzip <name>\tstore the gzip compressed input of partition <name> decompressed,\n"
+            "\t\t\tmay be repeated\n"
+            "\t-tar <archive>\tread partition files out of this uncompressed tar, by fullpath,\n"
+            "\t\t\tfalling back to src_dir for files the archive does not hold\n\n"
             "Examples:\n"
             "\t%s -pack src_dir update.img\tpack files\n"
+            "\t%s -tar images.tar -pack src_dir update.img\tpack partitions out of a tar\n"
+            "\t%s -pack src_dir - | ssh host 'cat > update.img'\tpack to a pipe\n"
             "\t%s -unpack update.img out_dir\tunpack files\n"
+            "\t%s -unpack update.img out_dir boot\tunpack only the boot partition\n"
+            "\tzstd -dc update.img.zst | %s -unpack - out_dir\tunpack from a pipe\n"
+            "\t%s -update update.img boot=Image/boot.img\treplace just the boot partition\n"
+            "\t%s -set-meta update.img FIRMWARE_VER=1.2.3\trestamp the version\n"
             "\t%s -CMDLINE src_dir > cmdline\tcapture CMDLINE fragment into cmdline\n",
+            appname, appname, appname, appname, appname, appname, appname, appname, appname, appname,
             appname, appname, appname, appname, appname, appname
             );
 }
@@ -1088,6 +4421,91 @@ int main( int argc, char** argv )
 
     fprintf( stderr, "%s version: " VERSION "\n\n", appname );
 
+    // options come ahead of the command
+    while( argc > 2 )
+    {
+        if( strcmp( argv[1], "-j" ) == 0 )
+        {
+            int jobs = atoi( argv[2] );
+
+            if( jobs < 1 )
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+
+            Jobs = jobs;
+
+            argc -= 2;
+            argv += 2;
+        }
+        else if( strcmp( argv[1], "-align" ) == 0 )
+        {
+            char*           end;
+            unsigned long   align = strtoul( argv[2], &end, 0 );
+
+            if( *end == 'k' || *end == 'K' )
+                align <<= 10, ++end;
+            else if( *end == 'm' || *end == 'M' )
+                align <<= 20, ++end;
+
+            if( *end || align < PART_BLOCK || align > (1u << 30) || ( align & (align - 1) ) )
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+
+            Align = align;
+
+            argc -= 2;
+            argv += 2;
+        }
+        else if( strcmp( argv[1], "-ext" ) == 0 )
+        {
+            Extended = true;
+
+            argc -= 1;
+            argv += 1;
+        }
+        else if( strcmp( argv[1], "-tar" ) == 0 )
+        {
+            TarFile = argv[2];
+
+            argc -= 2;
+            argv += 2;
+        }
+        else if( strcmp( argv[1], "-ext4-free" ) == 0 )
+        {
+            Ext4Free = true;
+
+            argc -= 1;
+            argv += 1;
+        }
+        else if( strcmp( argv[1], "-verity" ) == 0 )
+        {
+            VerityParts.push_back( argv[2] );
+
+            argc -= 2;
+            argv += 2;
+        }
+        else if( strcmp( argv[1], "-gunzip" ) == 0 )
+        {
+            GunzipParts.push_back( argv[2] );
+
+            argc -= 2;
+            argv += 2;
+        }
+        else if( strcmp( argv[1], "-dedup" ) == 0 )
+        {
+            DedupContent = true;
+
+            argc -= 1;
+            argv += 1;
+        }
+        else
+            break;
+    }
+
     if( argc < 3 )
     {
         usage();
@@ -1104,9 +4522,19 @@ int main( int argc, char** argv )
             printf( "Packing failed!\n" );
     }
 
-    else if( strcmp( argv[1], "-unpack" ) == 0 && argc == 4 )
+    else if( strcmp( argv[1], "-batch" ) == 0 && argc == 3 )
+    {
+        ret = pack_batch( argv[2] );
+
+        if( ret == 0 )
+            printf( "Packed OK.\n" );
+        else
+            printf( "Packing failed!\n" );
+    }
+
+    else if( strcmp( argv[1], "-unpack" ) == 0 && argc >= 4 )
     {
-        ret = unpack_update( argv[2], argv[3] );
+        ret = unpack_update( argv[2], argv[3], std::vector<std::string>( argv + 4, argv + argc ) );
 
         if( ret == 0 )
             printf( "UnPacked OK.\n" );
@@ -1114,6 +4542,36 @@ int main( int argc, char** argv )
             printf( "UnPack failed!\n" );
     }
 
+    else if( strcmp( argv[1], "-verify" ) == 0 && argc >= 3 )
+    {
+        ret = unpack_update( argv[2], NULL, std::vector<std::string>( argv + 3, argv + argc ) );
+
+        if( ret == 0 )
+            printf( "Verified OK.\n" );
+        else
+            printf( "Verify failed!\n" );
+    }
+
+    else if( strcmp( argv[1], "-update" ) == 0 && argc >= 4 )
+    {
+        ret = update_image( argv[2], std::vector<std::string>( argv + 3, argv + argc ) );
+
+        if( ret == 0 )
+            printf( "Updated OK.\n" );
+        else
+            printf( "Update failed!\n" );
+    }
+
+    else if( strcmp( argv[1], "-set-meta" ) == 0 && argc >= 4 )
+    {
+        ret = set_meta( argv[2], std::vector<std::string>( argv + 3, argv + argc ) );
+
+        if( ret == 0 )
+            printf( "Set OK.\n" );
+        else
+            printf( "Setting failed!\n" );
+    }
+
     else if( strcmp( argv[1], "-CMDLINE" ) == 0 && argc == 3 )
     {
         ret = compute_cmdline( argv[2] );
@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "rkrom.h"
 #include "rkafp.h"
@@ -14,41 +15,69 @@ static const char* progname;
 
 
 /**
- * Function import_data
- *
- * @param infile which file to import
+ * Function input_size
+ * returns the length of the open file in_fp when it can be known before
+ * reading it, i.e. for a regular file, else -1.
  */
-unsigned import_data( const char* infile, void* head, size_t head_len, FILE* fp )
+static off_t input_size( FILE* in_fp )
 {
-    unsigned readlen;
-    char buffer[1024*16];
+    struct stat st;
 
-    FILE* in_fp = fopen( infile, "rb" );
+    if( fstat( fileno( in_fp ), &st ) || !S_ISREG( st.st_mode ) )
+        return -1;
+
+    return st.st_size;
+}
 
-    if( !in_fp )
-        goto import_end;
 
-    // read in the UPDATE_HEADER to a special place in caller.
-    readlen = fread( head, 1, head_len, in_fp );
+/**
+ * Function import_data
+ * copies head, the first head_len bytes already read from in_fp, and then the
+ * rest of in_fp to fp.  If md5_ctx is not NULL, everything written is also
+ * fed to it.
+ *
+ * @return unsigned - the total count of bytes copied.
+ */
+unsigned import_data( FILE* in_fp, const void* head, unsigned head_len, FILE* fp, MD5_CTX* md5_ctx )
+{
+    unsigned readlen = head_len;
+    char buffer[1024*16];
 
-    if( readlen )
+    if( head_len )
     {
-        fwrite( head, 1, readlen, fp );
+        fwrite( head, 1, head_len, fp );
+
+        if( md5_ctx )
+            MD5_Update( md5_ctx, head, head_len );
     }
 
     unsigned len;
     while( (len = fread( buffer, 1, sizeof(buffer), in_fp ) ) != 0 )
     {
         fwrite( buffer, 1, len, fp );
+
+        if( md5_ctx )
+            MD5_Update( md5_ctx, buffer, len );
+
         readlen += len;
     }
 
-import_end:
+    return readlen;
+}
 
-    if( in_fp )
-        fclose( in_fp );
 
-    return readlen;
+void write_md5sum( FILE* fp, MD5_CTX* md5_ctx )
+{
+    unsigned char digest[16];
+
+    MD5_Final( digest, md5_ctx );
+
+    fseek( fp, 0, SEEK_END );
+
+    for( int i = 0; i < 16; ++i )
+    {
+        fprintf( fp, "%02hhx", digest[i] );
+    }
 }
 
 
@@ -67,12 +96,7 @@ void append_md5sum( FILE* fp )
         MD5_Update( &md5_ctx, buffer, len );
     }
 
-    MD5_Final( (unsigned char*) buffer, &md5_ctx );
-
-    for( int i = 0; i < 16; ++i )
-    {
-        fprintf( fp, "%02hhx", buffer[i] );
-    }
+    write_md5sum( fp, &md5_ctx );
 }
 
 
@@ -119,57 +143,74 @@ int pack_rom( int chiptype,
     rom_hdr.minute = local_time.tm_min;
     rom_hdr.second = local_time.tm_sec;
 
-    FILE* fp = fopen( outfile, "wb+" );
+    FILE*       fp = NULL;
+    FILE*       loader_fp = NULL;
+    FILE*       image_fp = NULL;
 
-    if( !fp )
+    MD5_CTX     md5_ctx;
+    bool        one_pass;
+    off_t       loader_size;
+    off_t       image_size;
+    unsigned    loader_head;
+    unsigned    image_head;
+    int         i;
+
+    // open the boot loader, typically <uboot's_full_name>.bin
+    loader_fp = fopen( loader_filename, "rb" );
+
+    if( !loader_fp )
     {
-        fprintf( stderr, "Can't open file %s\n, reason: %s\n", outfile, strerror( errno ) );
+        fprintf( stderr, "Can't open boot loader file '%s': %s\n", loader_filename, strerror( errno ) );
         goto pack_fail;
     }
 
-    // temporarily fill the file with an incomplete header at its beginning.
-    if( 1 != fwrite( &rom_hdr, sizeof(rom_hdr), 1, fp ) )
+    image_fp = fopen( image_filename, "rb" );
+
+    if( !image_fp )
+    {
+        fprintf( stderr, "Can't open image file '%s': %s\n", image_filename, strerror( errno ) );
         goto pack_fail;
+    }
 
-    printf( "rom version: %x.%x.%x\n",
-            (rom_hdr.version >> 24) & 0xFF,
-            (rom_hdr.version >> 16) & 0xFF,
-            (rom_hdr.version) & 0xFFFF );
+    // Everything the RKFW_HEADER needs is known before any payload is copied
+    // when both inputs are regular files: their sizes and the UPDATE_HEADER
+    // which leads the image.  Then the header can be written first and the MD5
+    // streamed along with the copy.  Otherwise fall back to patching the header
+    // afterwards and reading the whole output again for the MD5.
+    loader_head = fread( &loader_hdr, 1, sizeof(loader_hdr), loader_fp );
+    image_head  = fread( &rkaf_hdr, 1, sizeof(rkaf_hdr), image_fp );
 
-    printf( "build time: %d-%02d-%02d %02d:%02d:%02d\n",
-            rom_hdr.year, rom_hdr.month, rom_hdr.day,
-            rom_hdr.hour, rom_hdr.minute, rom_hdr.second );
+    loader_size = input_size( loader_fp );
+    image_size  = input_size( image_fp );
 
-    printf( "chip: %x\n", rom_hdr.chip );
+    one_pass = loader_size >= 0 && image_size >= 0;
 
-    fprintf( stderr, "generate image...\n" );
-
-    // open the boot loader, typically <uboot's_full_name>.bin
-    rom_hdr.loader_length = import_data( loader_filename,
-            &loader_hdr,
-            sizeof(loader_hdr),
-            fp );
-
-    if( rom_hdr.loader_length < sizeof(loader_hdr) )
+    if( loader_head < sizeof(loader_hdr) )
     {
         fprintf( stderr, "boot loader file '%s' is not long enough\n", loader_filename );
         goto pack_fail;
     }
 
-    rom_hdr.image_offset = rom_hdr.loader_offset + rom_hdr.loader_length;
-    rom_hdr.image_length = import_data( image_filename, &rkaf_hdr, sizeof(rkaf_hdr), fp );
-
-    if( rom_hdr.image_length < sizeof(rkaf_hdr) )
+    if( image_head < sizeof(rkaf_hdr) )
     {
         fprintf( stderr, "invalid rom :\"\%s\"\n", image_filename );
         goto pack_fail;
     }
 
+    if( one_pass && ( loader_size > UINT_MAX || image_size > UINT_MAX ) )
+    {
+        fprintf( stderr, "input files are too big for the 32 bit RKFW_HEADER length fields\n" );
+        goto pack_fail;
+    }
+
+    rom_hdr.loader_length = loader_size;
+    rom_hdr.image_offset  = rom_hdr.loader_offset + rom_hdr.loader_length;
+    rom_hdr.image_length  = image_size;
+
     rom_hdr.unknown2 = 1;
 
     rom_hdr.system_fstype = 0;
 
-    int i;
     for( i = 0; i < rkaf_hdr.num_parts; ++i )
     {
         if( strcmp( rkaf_hdr.parts[i].name, "backup" ) == 0 )
@@ -182,16 +223,66 @@ int pack_rom( int chiptype,
     else
         rom_hdr.backup_endpos = 0;
 
-    fseek( fp, 0, SEEK_SET );
+    fp = fopen( outfile, "wb+" );
 
+    if( !fp )
+    {
+        fprintf( stderr, "Can't open file %s\n, reason: %s\n", outfile, strerror( errno ) );
+        goto pack_fail;
+    }
+
+    // when not one_pass, this is an incomplete header to be rewritten later.
     if( 1 != fwrite( &rom_hdr, sizeof(rom_hdr), 1, fp ) )
         goto pack_fail;
 
-    fprintf( stderr, "append md5sum...\n" );
+    MD5_Init( &md5_ctx );
+    MD5_Update( &md5_ctx, &rom_hdr, sizeof(rom_hdr) );
 
-    append_md5sum( fp );    // compute checksum on entire output file and append
+    printf( "rom version: %x.%x.%x\n",
+            (rom_hdr.version >> 24) & 0xFF,
+            (rom_hdr.version >> 16) & 0xFF,
+            (rom_hdr.version) & 0xFFFF );
+
+    printf( "build time: %d-%02d-%02d %02d:%02d:%02d\n",
+            rom_hdr.year, rom_hdr.month, rom_hdr.day,
+            rom_hdr.hour, rom_hdr.minute, rom_hdr.second );
+
+    printf( "chip: %x\n", rom_hdr.chip );
+
+    fprintf( stderr, "generate image...\n" );
+
+    if( one_pass )
+    {
+        if( import_data( loader_fp, &loader_hdr, loader_head, fp, &md5_ctx ) != rom_hdr.loader_length ||
+            import_data( image_fp, &rkaf_hdr, image_head, fp, &md5_ctx ) != rom_hdr.image_length )
+        {
+            fprintf( stderr, "an input file changed size while it was being copied\n" );
+            goto pack_fail;
+        }
+
+        fprintf( stderr, "append md5sum...\n" );
+
+        write_md5sum( fp, &md5_ctx );
+    }
+    else
+    {
+        rom_hdr.loader_length = import_data( loader_fp, &loader_hdr, loader_head, fp, NULL );
+        rom_hdr.image_offset  = rom_hdr.loader_offset + rom_hdr.loader_length;
+        rom_hdr.image_length  = import_data( image_fp, &rkaf_hdr, image_head, fp, NULL );
+
+        fseek( fp, 0, SEEK_SET );
+
+        if( 1 != fwrite( &rom_hdr, sizeof(rom_hdr), 1, fp ) )
+            goto pack_fail;
+
+        fprintf( stderr, "append md5sum...\n" );
+
+        append_md5sum( fp );    // compute checksum on entire output file and append
+    }
 
     fclose( fp );
+    fclose( image_fp );
+    fclose( loader_fp );
     fprintf( stderr, "success!\n" );
 
     return 0;
@@ -201,6 +292,12 @@ pack_fail:
     if( fp )
         fclose( fp );
 
+    if( image_fp )
+        fclose( image_fp );
+
+    if( loader_fp )
+        fclose( loader_fp );
+
     return -1;
 }
 
@@ -47,7 +47,83 @@ struct UPDATE_HEADER {
     uint32_t    num_parts;
     UPDATE_PART parts[16];
 
-    char        reserved[116];
+    char        reserved[116];      // may hold a PART_CRCS
+};
+
+
+/**
+ * Struct PART_CRCS
+ * is an optional table of per partition CRCs kept in UPDATE_HEADER::reserved,
+ * which older tools leave zeroed and ignore.  crc[i] is the Rockchip CRC of
+ * the part_bytecount bytes at part_offset of parts[i], zero for SELF.  It lets
+ * one partition be checked without reading the whole image.  The CRC trailing
+ * the image is still written and still covers everything, this table included.
+ */
+struct PART_CRCS {
+    char        magic[4];
+
+#define PART_CRCS_MAGIC     "PCRC"
+#define PART_CRCS_VERSION   1
+
+    uint32_t    version;
+    uint32_t    crc[16];
+};
+
+
+/// the PART_CRCS of aHeader, or NULL if it has none
+inline const PART_CRCS* part_crcs( const UPDATE_HEADER& aHeader )
+{
+    const PART_CRCS* t = (const PART_CRCS*) aHeader.reserved;
+
+    if( memcmp( t->magic, PART_CRCS_MAGIC, sizeof(t->magic) ) || t->version != PART_CRCS_VERSION )
+        return NULL;
+
+    return t;
+}
+
+
+/**
+ * Struct UPDATE_PART64
+ * is the partition record of the extended container, an UPDATE_PART with 64
+ * bit offsets and lengths and with the partition's CRC built in.
+ */
+struct UPDATE_PART64 {
+    char         name[32];
+    char         fullpath[60];
+    uint32_t     flash_size;        // how many sectors to reserve for this partition in the flash.
+    uint32_t     flash_offset;      // sector offset within the flash memory.
+    uint32_t     crc;               // of the part_bytecount bytes at part_offset, zero for SELF
+    uint64_t     part_offset;       // starting byte offset within the image file
+    uint64_t     padded_size;       // bytes from part_offset to the next partition
+    uint64_t     part_bytecount;    // size of partition source (bytes)
+};
+
+
+/**
+ * Struct UPDATE_HEADER64
+ * starts the extended container, an opt-in variant of the update.img format
+ * for images past 4 gbytes or with more than 16 partitions.  It is followed
+ * directly by num_parts UPDATE_PART64 records, then come the payloads and,
+ * as in the original format, the CRC of everything before it.  Rockchip's own
+ * tools do not read this variant.
+ */
+struct UPDATE_HEADER64 {
+    char        magic[4];
+
+#define RKAX_MAGIC      "RKAX"
+#define RKAX_VERSION    1
+
+    uint32_t    format;             // RKAX_VERSION
+    uint32_t    num_parts;
+    uint32_t    unknown1;
+    uint64_t    length;             // of the image without its trailing CRC
+    char        model[34];
+    char        id[30];
+    char        manufacturer[56];
+    uint32_t    version;
+    uint32_t    flags;
+
+#define RKAX_PART_CRCS  1           // the crc of the UPDATE_PART64s are filled in
 };
 
 
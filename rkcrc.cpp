@@ -122,7 +122,7 @@ int main( int argc, char* argv[] )
     int nr;
     while( ( nr = read( in, buf, sizeof(buf) ) ) > 0 )
     {
-        RKCRC( crc, buf, nr );
+        crc = rkcrc_update( crc, buf, nr );
         write( out, buf, nr );
     }
 
@@ -0,0 +1,519 @@
+/*-
+ * Copyright (c) 2010 FUKAUMI Naoki.
+ * Copyright (c) 2026 afptool contributors.
+ * All rights reserved.
+ *
+ * The table _t and the bytewise kernel come from rkcrc.h and keep its
+ * license, the other kernels are distributed under the same terms.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Kernels behind rkcrc_update().  All of them compute exactly what the original
+ * one-byte-at-a-time RKCRC macro did, they just get there faster:
+ *
+ *  bytewise    the original loop over the 256 entry table _t.
+ *  slice8      8 bytes per step using 8 tables, good for 32 bit hosts.
+ *  slice16     16 bytes per step using 16 tables, 16 KiB of L1 on 64 bit hosts.
+ *  pclmul      carry-less multiply folding of 4 x 128 bits, x86 SSE4.2 + PCLMULQDQ.
+ *  vpclmul     the same folding over 4 x 512 bits, x86 AVX-512BW + VPCLMULQDQ.
+ *
+ * Table _t[i] is i * x^32 mod P.  Table s_tab[k][i] is i * x^(32+8k) mod P, so a
+ * byte followed by k more bytes in the same step is looked up in s_tab[k].
+ *
+ * The folding kernels treat 16 message bytes, first byte most significant, as
+ * a 128 bit polynomial.  Because this CRC is not reflected, bit i of a register
+ * is simply the coefficient of x^i and PCLMULQDQ needs no bit reversal.  An
+ * accumulator A followed by D more bits of message B is folded into
+ *
+ *      A.hi * (x^(D+64) mod P)  ^  A.lo * (x^D mod P)  ^  B
+ *
+ * which is congruent to A * x^D + B and still fits in 128 bits.  What remains
+ * at the end is congruent to the whole message, so running the table kernel
+ * over its 16 bytes from a zero state yields the CRC.  That avoids a Barrett
+ * reduction and keeps every kernel bit-identical to the byte loop.
+ *
+ * Since the CRC is linear, the state after n more bytes of message B is
+ * crc * x^(8n) + crc(B) mod P, and crc(B) is 0 when B is all zeros.  Both
+ * rkcrc_combine() and rkcrc_zeros() get x^(8n) mod P by square and multiply
+ * over the table s_x2n[k] = x^(2^k) mod P, the polynomial form of the usual
+ * GF(2) matrix exponentiation, with 32 x 32 bit products instead of 32 x 32
+ * matrices.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rkcrc.h"
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+ #define RKCRC_X86      1
+ #include <immintrin.h>
+#endif
+
+
+static const uint32_t _t[256] = {
+	0x00000000, 0x04c10db7, 0x09821b6e, 0x0d4316d9,
+	0x130436dc, 0x17c53b6b, 0x1a862db2, 0x1e472005,
+	0x26086db8, 0x22c9600f, 0x2f8a76d6, 0x2b4b7b61,
+	0x350c5b64, 0x31cd56d3, 0x3c8e400a, 0x384f4dbd,
+	0x4c10db70, 0x48d1d6c7, 0x4592c01e, 0x4153cda9,
+	0x5f14edac, 0x5bd5e01b, 0x5696f6c2, 0x5257fb75,
+	0x6a18b6c8, 0x6ed9bb7f, 0x639aada6, 0x675ba011,
+	0x791c8014, 0x7ddd8da3, 0x709e9b7a, 0x745f96cd,
+	0x9821b6e0, 0x9ce0bb57, 0x91a3ad8e, 0x9562a039,
+	0x8b25803c, 0x8fe48d8b, 0x82a79b52, 0x866696e5,
+	0xbe29db58, 0xbae8d6ef, 0xb7abc036, 0xb36acd81,
+	0xad2ded84, 0xa9ece033, 0xa4aff6ea, 0xa06efb5d,
+	0xd4316d90, 0xd0f06027, 0xddb376fe, 0xd9727b49,
+	0xc7355b4c, 0xc3f456fb, 0xceb74022, 0xca764d95,
+	0xf2390028, 0xf6f80d9f, 0xfbbb1b46, 0xff7a16f1,
+	0xe13d36f4, 0xe5fc3b43, 0xe8bf2d9a, 0xec7e202d,
+	0x34826077, 0x30436dc0, 0x3d007b19, 0x39c176ae,
+	0x278656ab, 0x23475b1c, 0x2e044dc5, 0x2ac54072,
+	0x128a0dcf, 0x164b0078, 0x1b0816a1, 0x1fc91b16,
+	0x018e3b13, 0x054f36a4, 0x080c207d, 0x0ccd2dca,
+	0x7892bb07, 0x7c53b6b0, 0x7110a069, 0x75d1adde,
+	0x6b968ddb, 0x6f57806c, 0x621496b5, 0x66d59b02,
+	0x5e9ad6bf, 0x5a5bdb08, 0x5718cdd1, 0x53d9c066,
+	0x4d9ee063, 0x495fedd4, 0x441cfb0d, 0x40ddf6ba,
+	0xaca3d697, 0xa862db20, 0xa521cdf9, 0xa1e0c04e,
+	0xbfa7e04b, 0xbb66edfc, 0xb625fb25, 0xb2e4f692,
+	0x8aabbb2f, 0x8e6ab698, 0x8329a041, 0x87e8adf6,
+	0x99af8df3, 0x9d6e8044, 0x902d969d, 0x94ec9b2a,
+	0xe0b30de7, 0xe4720050, 0xe9311689, 0xedf01b3e,
+	0xf3b73b3b, 0xf776368c, 0xfa352055, 0xfef42de2,
+	0xc6bb605f, 0xc27a6de8, 0xcf397b31, 0xcbf87686,
+	0xd5bf5683, 0xd17e5b34, 0xdc3d4ded, 0xd8fc405a,
+	0x6904c0ee, 0x6dc5cd59, 0x6086db80, 0x6447d637,
+	0x7a00f632, 0x7ec1fb85, 0x7382ed5c, 0x7743e0eb,
+	0x4f0cad56, 0x4bcda0e1, 0x468eb638, 0x424fbb8f,
+	0x5c089b8a, 0x58c9963d, 0x558a80e4, 0x514b8d53,
+	0x25141b9e, 0x21d51629, 0x2c9600f0, 0x28570d47,
+	0x36102d42, 0x32d120f5, 0x3f92362c, 0x3b533b9b,
+	0x031c7626, 0x07dd7b91, 0x0a9e6d48, 0x0e5f60ff,
+	0x101840fa, 0x14d94d4d, 0x199a5b94, 0x1d5b5623,
+	0xf125760e, 0xf5e47bb9, 0xf8a76d60, 0xfc6660d7,
+	0xe22140d2, 0xe6e04d65, 0xeba35bbc, 0xef62560b,
+	0xd72d1bb6, 0xd3ec1601, 0xdeaf00d8, 0xda6e0d6f,
+	0xc4292d6a, 0xc0e820dd, 0xcdab3604, 0xc96a3bb3,
+	0xbd35ad7e, 0xb9f4a0c9, 0xb4b7b610, 0xb076bba7,
+	0xae319ba2, 0xaaf09615, 0xa7b380cc, 0xa3728d7b,
+	0x9b3dc0c6, 0x9ffccd71, 0x92bfdba8, 0x967ed61f,
+	0x8839f61a, 0x8cf8fbad, 0x81bbed74, 0x857ae0c3,
+	0x5d86a099, 0x5947ad2e, 0x5404bbf7, 0x50c5b640,
+	0x4e829645, 0x4a439bf2, 0x47008d2b, 0x43c1809c,
+	0x7b8ecd21, 0x7f4fc096, 0x720cd64f, 0x76cddbf8,
+	0x688afbfd, 0x6c4bf64a, 0x6108e093, 0x65c9ed24,
+	0x11967be9, 0x1557765e, 0x18146087, 0x1cd56d30,
+	0x02924d35, 0x06534082, 0x0b10565b, 0x0fd15bec,
+	0x379e1651, 0x335f1be6, 0x3e1c0d3f, 0x3add0088,
+	0x249a208d, 0x205b2d3a, 0x2d183be3, 0x29d93654,
+	0xc5a71679, 0xc1661bce, 0xcc250d17, 0xc8e400a0,
+	0xd6a320a5, 0xd2622d12, 0xdf213bcb, 0xdbe0367c,
+	0xe3af7bc1, 0xe76e7676, 0xea2d60af, 0xeeec6d18,
+	0xf0ab4d1d, 0xf46a40aa, 0xf9295673, 0xfde85bc4,
+	0x89b7cd09, 0x8d76c0be, 0x8035d667, 0x84f4dbd0,
+	0x9ab3fbd5, 0x9e72f662, 0x9331e0bb, 0x97f0ed0c,
+	0xafbfa0b1, 0xab7ead06, 0xa63dbbdf, 0xa2fcb668,
+	0xbcbb966d, 0xb87a9bda, 0xb5398d03, 0xb1f880b4,
+};
+
+
+static uint32_t s_tab[16][256];
+
+static uint32_t s_x2n[64+3];    // room for x^(8n) with any 64 bit n
+
+
+static uint32_t crc_bytewise( uint32_t crc, const uint8_t* p, size_t len )
+{
+    while( len-- > 0 )
+        crc = (crc << 8) ^ _t[(crc >> 24) ^ *p++];
+
+    return crc;
+}
+
+
+static uint32_t crc_slice8( uint32_t crc, const uint8_t* p, size_t len )
+{
+    while( len >= 8 )
+    {
+        crc ^= (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+
+        crc = s_tab[7][crc >> 24]           ^ s_tab[6][(crc >> 16) & 0xff] ^
+              s_tab[5][(crc >> 8) & 0xff]   ^ s_tab[4][crc & 0xff] ^
+              s_tab[3][p[4]] ^ s_tab[2][p[5]] ^ s_tab[1][p[6]] ^ s_tab[0][p[7]];
+
+        p   += 8;
+        len -= 8;
+    }
+
+    return crc_bytewise( crc, p, len );
+}
+
+
+static uint32_t crc_slice16( uint32_t crc, const uint8_t* p, size_t len )
+{
+    while( len >= 16 )
+    {
+        crc ^= (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+
+        crc = s_tab[15][crc >> 24]          ^ s_tab[14][(crc >> 16) & 0xff] ^
+              s_tab[13][(crc >> 8) & 0xff]  ^ s_tab[12][crc & 0xff] ^
+              s_tab[11][p[4]]  ^ s_tab[10][p[5]]  ^ s_tab[9][p[6]]  ^ s_tab[8][p[7]] ^
+              s_tab[7][p[8]]   ^ s_tab[6][p[9]]   ^ s_tab[5][p[10]] ^ s_tab[4][p[11]] ^
+              s_tab[3][p[12]]  ^ s_tab[2][p[13]]  ^ s_tab[1][p[14]] ^ s_tab[0][p[15]];
+
+        p   += 16;
+        len -= 16;
+    }
+
+    return crc_bytewise( crc, p, len );
+}
+
+
+#if defined(RKCRC_X86)
+
+/// x^n mod P, as the 32 low coefficients.
+static uint32_t xpow_mod( unsigned n )
+{
+    uint32_t r = _t[1];     // x^32 mod P is the polynomial itself
+
+    for( ; n > 32; --n )
+        r = (r << 1) ^ ( (r & 0x80000000) ? _t[1] : 0 );
+
+    return r;
+}
+
+
+// fold constants, high qword multiplies A.hi and low qword multiplies A.lo.
+static uint64_t s_k128[2];      // D = 128
+static uint64_t s_k512[2];      // D = 512
+static uint64_t s_k2048[2];     // D = 2048
+
+
+static void init_fold_constants()
+{
+    s_k128[1]  = xpow_mod( 128 + 64 );
+    s_k128[0]  = xpow_mod( 128 );
+    s_k512[1]  = xpow_mod( 512 + 64 );
+    s_k512[0]  = xpow_mod( 512 );
+    s_k2048[1] = xpow_mod( 2048 + 64 );
+    s_k2048[0] = xpow_mod( 2048 );
+}
+
+
+#define FOLD_TARGET     __attribute__(( target( "sse4.2,pclmul" ) ))
+#define FOLD512_TARGET  __attribute__(( target( "sse4.2,pclmul,avx512f,avx512bw,vpclmulqdq" ) ))
+
+
+FOLD_TARGET static inline __m128i bswap128( __m128i v )
+{
+    return _mm_shuffle_epi8( v, _mm_set_epi8( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 ) );
+}
+
+
+FOLD_TARGET static inline __m128i load128( const uint8_t* p )
+{
+    return bswap128( _mm_loadu_si128( (const __m128i*) p ) );
+}
+
+
+FOLD_TARGET static inline __m128i fold128( __m128i a, __m128i k, __m128i b )
+{
+    return _mm_xor_si128( _mm_xor_si128( _mm_clmulepi64_si128( a, k, 0x11 ),
+                                         _mm_clmulepi64_si128( a, k, 0x00 ) ), b );
+}
+
+
+/**
+ * Function finish128
+ * folds the remaining whole 16 byte blocks into accumulator a, reduces it
+ * with the table kernel and does any ragged tail the same way.
+ */
+FOLD_TARGET static uint32_t finish128( __m128i a, const uint8_t* p, size_t len )
+{
+    const __m128i k128 = _mm_loadu_si128( (const __m128i*) s_k128 );
+
+    for( ; len >= 16; p += 16, len -= 16 )
+        a = fold128( a, k128, load128( p ) );
+
+    uint8_t rem[16];
+
+    _mm_storeu_si128( (__m128i*) rem, bswap128( a ) );
+
+    return crc_slice16( crc_slice16( 0, rem, sizeof(rem) ), p, len );
+}
+
+
+FOLD_TARGET static uint32_t crc_pclmul( uint32_t crc, const uint8_t* p, size_t len )
+{
+    if( len < 128 )
+        return crc_slice16( crc, p, len );
+
+    const __m128i k128 = _mm_loadu_si128( (const __m128i*) s_k128 );
+    const __m128i k512 = _mm_loadu_si128( (const __m128i*) s_k512 );
+
+    // the incoming state is xored into the first 4 message bytes.
+    __m128i x0 = _mm_xor_si128( load128( p ), _mm_set_epi32( (int) crc, 0, 0, 0 ) );
+    __m128i x1 = load128( p + 16 );
+    __m128i x2 = load128( p + 32 );
+    __m128i x3 = load128( p + 48 );
+
+    for( p += 64, len -= 64; len >= 64; p += 64, len -= 64 )
+    {
+        x0 = fold128( x0, k512, load128( p ) );
+        x1 = fold128( x1, k512, load128( p + 16 ) );
+        x2 = fold128( x2, k512, load128( p + 32 ) );
+        x3 = fold128( x3, k512, load128( p + 48 ) );
+    }
+
+    x0 = fold128( x0, k128, x1 );
+    x0 = fold128( x0, k128, x2 );
+    x0 = fold128( x0, k128, x3 );
+
+    return finish128( x0, p, len );
+}
+
+
+FOLD512_TARGET static inline __m512i load512( const uint8_t* p )
+{
+    // bswap128() within each of the four 128 bit lanes
+    const __m512i rev = _mm512_set_epi64(
+            0x0001020304050607, 0x08090a0b0c0d0e0f, 0x0001020304050607, 0x08090a0b0c0d0e0f,
+            0x0001020304050607, 0x08090a0b0c0d0e0f, 0x0001020304050607, 0x08090a0b0c0d0e0f );
+
+    return _mm512_shuffle_epi8( _mm512_loadu_si512( p ), rev );
+}
+
+
+FOLD512_TARGET static inline __m512i broadcast512( const uint64_t k[2] )
+{
+    return _mm512_set_epi64( k[1], k[0], k[1], k[0], k[1], k[0], k[1], k[0] );
+}
+
+
+FOLD512_TARGET static inline __m512i fold512( __m512i a, __m512i k, __m512i b )
+{
+    return _mm512_xor_si512( _mm512_xor_si512( _mm512_clmulepi64_epi128( a, k, 0x11 ),
+                                               _mm512_clmulepi64_epi128( a, k, 0x00 ) ), b );
+}
+
+
+FOLD512_TARGET static uint32_t crc_vpclmul( uint32_t crc, const uint8_t* p, size_t len )
+{
+    if( len < 512 )
+        return crc_pclmul( crc, p, len );
+
+    const __m512i k512  = broadcast512( s_k512 );
+    const __m512i k2048 = broadcast512( s_k2048 );
+    const __m128i k128  = _mm_loadu_si128( (const __m128i*) s_k128 );
+
+    __m512i z0 = _mm512_xor_si512( load512( p ),
+            _mm512_inserti32x4( _mm512_setzero_si512(), _mm_set_epi32( (int) crc, 0, 0, 0 ), 0 ) );
+    __m512i z1 = load512( p + 64 );
+    __m512i z2 = load512( p + 128 );
+    __m512i z3 = load512( p + 192 );
+
+    for( p += 256, len -= 256; len >= 256; p += 256, len -= 256 )
+    {
+        z0 = fold512( z0, k2048, load512( p ) );
+        z1 = fold512( z1, k2048, load512( p + 64 ) );
+        z2 = fold512( z2, k2048, load512( p + 128 ) );
+        z3 = fold512( z3, k2048, load512( p + 192 ) );
+    }
+
+    z0 = fold512( z0, k512, z1 );
+    z0 = fold512( z0, k512, z2 );
+    z0 = fold512( z0, k512, z3 );
+
+    for( ; len >= 64; p += 64, len -= 64 )
+        z0 = fold512( z0, k512, load512( p ) );
+
+    // lane 0 holds the earliest 16 bytes
+    __m128i lanes[4];
+
+    _mm512_storeu_si512( lanes, z0 );
+    _mm256_zeroupper();
+
+    __m128i x = lanes[0];
+
+    x = fold128( x, k128, lanes[1] );
+    x = fold128( x, k128, lanes[2] );
+    x = fold128( x, k128, lanes[3] );
+
+    return finish128( x, p, len );
+}
+
+
+static bool has_pclmul()
+{
+    return __builtin_cpu_supports( "sse4.2" ) && __builtin_cpu_supports( "pclmul" );
+}
+
+
+static bool has_vpclmul()
+{
+    return has_pclmul() &&
+        __builtin_cpu_supports( "avx512f" ) &&
+        __builtin_cpu_supports( "avx512bw" ) &&
+        __builtin_cpu_supports( "vpclmulqdq" );
+}
+
+#endif  // RKCRC_X86
+
+
+/// a * b mod P, Horner style from the top coefficient of a.
+static uint32_t multmodp( uint32_t a, uint32_t b )
+{
+    uint32_t p = 0;
+
+    for( uint32_t m = 0x80000000; m; m >>= 1 )
+    {
+        p = (p << 1) ^ ( (p & 0x80000000) ? _t[1] : 0 );
+
+        if( a & m )
+            p ^= b;
+    }
+
+    return p;
+}
+
+
+/// x^(8 * aBytes) mod P
+static uint32_t x8nmodp( uint64_t aBytes )
+{
+    uint32_t p = 1;     // x^0
+
+    for( unsigned k = 3; aBytes; aBytes >>= 1, ++k )
+    {
+        if( aBytes & 1 )
+            p = multmodp( s_x2n[k], p );
+    }
+
+    return p;
+}
+
+
+typedef uint32_t (*CRC_KERNEL)( uint32_t crc, const uint8_t* p, size_t len );
+
+struct ENGINE
+{
+    const char* name;
+    CRC_KERNEL  kernel;
+    bool        (*supported)();
+};
+
+
+static bool always()        { return true; }
+static bool is_64bit()      { return sizeof(void*) >= 8; }
+
+
+// widest first, the first supported entry wins unless RKCRC_ENGINE says otherwise.
+static const ENGINE s_engines[] = {
+#if defined(RKCRC_X86)
+    { "vpclmul",    crc_vpclmul,    has_vpclmul },
+    { "pclmul",     crc_pclmul,     has_pclmul },
+#endif
+    { "slice16",    crc_slice16,    is_64bit },
+    { "slice8",     crc_slice8,     always },
+    { "bytewise",   crc_bytewise,   always },
+};
+
+
+static const ENGINE* select_engine()
+{
+    for( int k = 0; k < 256; ++k )
+        s_tab[0][k] = _t[k];
+
+    for( int i = 1; i < 16; ++i )
+    {
+        for( int k = 0; k < 256; ++k )
+        {
+            uint32_t prev = s_tab[i-1][k];
+            s_tab[i][k] = (prev << 8) ^ _t[prev >> 24];
+        }
+    }
+
+    s_x2n[0] = 2;       // x^1
+
+    for( unsigned k = 1; k < sizeof(s_x2n)/sizeof(s_x2n[0]); ++k )
+        s_x2n[k] = multmodp( s_x2n[k-1], s_x2n[k-1] );
+
+#if defined(RKCRC_X86)
+    __builtin_cpu_init();       // we run before main()
+    init_fold_constants();
+#endif
+
+    const char* wanted = getenv( "RKCRC_ENGINE" );
+
+    if( wanted )
+    {
+        for( unsigned i = 0; i < sizeof(s_engines)/sizeof(s_engines[0]); ++i )
+        {
+            if( !strcmp( wanted, s_engines[i].name ) && s_engines[i].supported() )
+                return &s_engines[i];
+        }
+
+        fprintf( stderr, "RKCRC_ENGINE='%s' is unknown or not supported here, ignoring it\n", wanted );
+    }
+
+    for( unsigned i = 0; i < sizeof(s_engines)/sizeof(s_engines[0]); ++i )
+    {
+        if( s_engines[i].supported() )
+            return &s_engines[i];
+    }
+
+    return &s_engines[sizeof(s_engines)/sizeof(s_engines[0]) - 1];
+}
+
+
+// runs during static initialization, before main() and before any thread exists.
+static const ENGINE* s_engine = select_engine();
+
+
+uint32_t rkcrc_update( uint32_t aCrc, const void* aBuf, size_t aLen )
+{
+    return s_engine->kernel( aCrc, (const uint8_t*) aBuf, aLen );
+}
+
+
+uint32_t rkcrc_zeros( uint32_t aCrc, uint64_t aLen )
+{
+    if( !aCrc || !aLen )
+        return aCrc;
+
+    return multmodp( x8nmodp( aLen ), aCrc );
+}
+
+
+uint32_t rkcrc_combine( uint32_t aCrcA, uint32_t aCrcB, uint64_t aLenB )
+{
+    return rkcrc_zeros( aCrcA, aLenB ) ^ aCrcB;
+}
+
+
+const char* rkcrc_engine_name()
+{
+    return s_engine->name;
+}
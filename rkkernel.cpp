@@ -38,7 +38,7 @@ int pack_krnl( FILE* fp_in, FILE* fp_out )
     {
         header.length += readlen;
         fwrite( buf, 1, readlen, fp_out );
-        RKCRC( crc, buf, readlen );
+        crc = rkcrc_update( crc, buf, readlen );
     }
 
     fwrite( &crc, sizeof(crc), 1, fp_out );
@@ -84,7 +84,7 @@ int unpack_krnl( FILE* fp_in, FILE* fp_out )
     {
         length -= readlen;
         fwrite( buf, 1, readlen, fp_out );
-        RKCRC( crc, buf, readlen );
+        crc = rkcrc_update( crc, buf, readlen );
     }
 
     if( file_crc != crc )
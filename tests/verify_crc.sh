@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# afptool -verify of a whole image must fail when anything outside the
+# partition payloads, the header or the padding after a payload, is damaged.
+#
+# usage: verify_crc.sh <afptool> <scratch dir>
+
+AFPTOOL=$1
+WORK=$2
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+# flips the low bit of the byte at offset $2 of file $1
+flip()
+{
+    b=$( od -An -tu1 -j "$2" -N1 "$1" | tr -d ' ' )
+    printf "\\$( printf %o $(( b ^ 1 )) )" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+rm -rf "$WORK"
+mkdir -p "$WORK/src/Image" || exit 1
+cd "$WORK" || exit 1
+
+cat > src/parameter <<PARAM
+FIRMWARE_VER:4.4.2
+MACHINE_MODEL:rk3288
+MACHINE_ID:007
+MANUFACTURER:RK3288
+MAGIC: 0x5041524B
+CMDLINE:mtdparts=rk29xxnand:0x00002000@0x00002000(boot),-@0x00004000(linuxroot)
+PARAM
+
+cat > src/package-file <<PKG
+package-file    package-file
+parameter       parameter
+boot            Image/boot.img
+linuxroot       Image/rootfs.img
+PKG
+
+# sizes not a multiple of 512 so every payload is followed by padding
+head -c 70001 /dev/urandom > src/Image/boot.img
+head -c 30001 /dev/urandom > src/Image/rootfs.img
+
+"$AFPTOOL" -pack src good.img > pack.log 2>&1 || { cat pack.log; fail "pack"; }
+"$AFPTOOL" -verify good.img > /dev/null 2>&1 || fail "-verify of an intact image"
+
+# the model field of the header
+cp good.img header.img
+flip header.img 8
+"$AFPTOOL" -verify header.img > /dev/null 2>&1 && fail "-verify of an image with a damaged header"
+
+# the padding right after the boot payload
+offset=$( "$AFPTOOL" -verify good.img 2>/dev/null | awk '$1 == "Image/boot.img" { print $2 }' )
+[ -n "$offset" ] || fail "no boot partition listed"
+cp good.img padding.img
+flip padding.img $(( offset + 70001 ))
+"$AFPTOOL" -verify padding.img > /dev/null 2>&1 && fail "-verify of an image with damaged padding"
+
+echo "PASS"
+exit 0